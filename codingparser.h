@@ -0,0 +1,114 @@
+#ifndef CODINGPARSER_H
+#define CODINGPARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+class TargetMachine;
+namespace orc {
+class LLJIT;
+}
+}
+
+// libcodingparser: the compiler behind ./main, for linking into a process
+// that compiles many programs ("make libcodingparser" builds it from main.cpp
+// without main()). A Compiler sets LLVM up once; each compile() then lexes
+// and parses a program from memory and generates a module that the returned
+// CompilationUnit owns, together with its own LLVMContext.
+//
+// Every compile works on a context of its own, which the unit keeps, so
+// separate Compilers can be used on different threads at once; one Compiler,
+// whose target machine and JIT its compiles share, is used by one thread at a
+// time. Lexing is the one step that threads take turns at.
+//
+// Errors come back as diagnostics; nothing is printed, and unlike ./main the
+// lexer does not echo characters outside of tokens to stdout.
+
+struct CompilationContext;
+
+// An error in a program or in handling it. Syntax errors are at the byte
+// offset of the token they were found at; errors found later, such as an
+// unknown variable or a module the JIT rejects, have no position and are at
+// NoOffset.
+struct Diagnostic {
+    static constexpr size_t NoOffset = SIZE_MAX;
+
+    size_t Offset;
+    std::string Message;
+};
+
+// The form a module is written in (--emit=).
+enum class EmitKind { LL, BC, Obj, Exe };
+
+struct CompilerOptions {
+    llvm::OptimizationLevel OptLevel = llvm::OptimizationLevel::O0;
+    // As for -mcpu= and -mattr=; an empty CPU is the host triple's generic one
+    // and "native" the host's CPU with its features. A CPU the target does not
+    // know makes every compile() fail with a diagnostic saying so.
+    std::string CPU;
+    std::string Features;
+    // Fold constant expressions on the tree before codegen (--const-eval).
+    bool ConstEval = false;
+};
+
+// One compiled program. Units are independent of each other and of later
+// compiles; destroying one frees its module and context.
+class CompilationUnit {
+    friend class Compiler;
+
+    std::vector<Diagnostic> Diagnostics;
+    std::unique_ptr<CompilationContext> Context;
+    bool Valid = false;
+
+public:
+    CompilationUnit();
+    CompilationUnit(CompilationUnit &&);
+    CompilationUnit &operator=(CompilationUnit &&);
+    ~CompilationUnit();
+
+    // False if the program has errors, which diagnostics() lists.
+    bool ok() const { return Valid; }
+    const std::vector<Diagnostic> &diagnostics() const { return Diagnostics; }
+
+    // The module with main(), null after a syntax error and once run().
+    llvm::Module *module() const;
+    llvm::LLVMContext *context() const;
+};
+
+class Compiler {
+    CompilerOptions Options;
+    std::unique_ptr<llvm::TargetMachine> Target;
+    // Why Target is null; every compile reports it.
+    std::string TargetError;
+    std::unique_ptr<llvm::orc::LLJIT> JIT;
+
+public:
+    explicit Compiler(const CompilerOptions &Options = CompilerOptions());
+    ~Compiler();
+
+    CompilationUnit compile(llvm::StringRef Source);
+
+    // Writes the unit's module; Exe writes an object file, as Obj does.
+    // Returns false, with a diagnostic added to the unit, if it has no module,
+    // if code is asked for a unit that is not ok(), or if the target cannot
+    // write it.
+    bool emit(CompilationUnit &Unit, EmitKind Kind, llvm::raw_pwrite_stream &OS);
+
+    // Runs main() of an ok() unit in process and stores its result. The
+    // module is handed to the JIT, which the Compiler keeps for later runs,
+    // and freed again once main() returns; the unit is left without one.
+    // Returns false, with a diagnostic added to the unit, if it cannot run.
+    bool run(CompilationUnit &Unit, int &Result);
+};
+
+#endif
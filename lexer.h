@@ -0,0 +1,40 @@
+#ifndef CODINGPARSER_LEXER_H
+#define CODINGPARSER_LEXER_H
+
+#include <cstddef>
+#include <cstdio>
+
+// Token codes shared by the parser and both lexer backends. Single-character
+// tokens are returned as the character itself; lexer.l keeps its own copy of
+// these values.
+#define NUMBER 256
+#define IF 258
+#define ELSE 259
+#define WHILE 260
+#define IDENT 261
+
+// Implemented by the flex scanner (lexer.cpp) or by the hand-written scanner
+// (simd_lexer.cpp), selected at build time with LEXER=flex|simd.
+// For NUMBER yylval is the value, for IDENT the name's ID in the table
+// Symbols points to (symbol_table.h).
+int yylex();
+extern int yylval;
+
+// Where characters that are not part of any token are echoed, as flex's
+// default rule does; stdout unless set otherwise, and nowhere when null.
+extern FILE *yyecho;
+
+// Byte offset from the start of the input of the token last returned by
+// yylex(); once yylex() has returned 0 it is the length of the input.
+extern size_t yyoffset;
+
+// Makes the lexer scan [base, base + size - 2) in place instead of reading
+// stdin. As with flex, the last two bytes of the buffer must be NUL.
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
+YY_BUFFER_STATE yy_scan_buffer(char *base, size_t size);
+
+// Frees what yy_scan_buffer() returned, not the buffer itself. Once the input
+// has been lexed to the end, the next buffer's offsets start from 0 again.
+void yy_delete_buffer(YY_BUFFER_STATE b);
+
+#endif
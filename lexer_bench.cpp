@@ -0,0 +1,29 @@
+#include <chrono>
+#include <cstdio>
+
+#include "lexer.h"
+
+//===----------------------------------------------------------------------===//
+// Lexer benchmark
+//
+// Drains yylex() over stdin and reports the token count, a checksum of the
+// token stream and the elapsed time. Linked once against each backend (see
+// `make bench_lexer`); equal checksums mean both produced the same stream.
+//===----------------------------------------------------------------------===//
+int main()
+{
+    auto Start = std::chrono::steady_clock::now();
+
+    long Count = 0;
+    unsigned long Sum = 0;
+    for (int Tok; (Tok = yylex()) != 0; ++Count) {
+        Sum = Sum * 31 + Tok;
+        Sum = Sum * 31 + yyoffset;
+        if (Tok == NUMBER) Sum = Sum * 31 + (unsigned)yylval;
+    }
+
+    std::chrono::duration<double, std::milli> Elapsed = std::chrono::steady_clock::now() - Start;
+    Sum = Sum * 31 + yyoffset;
+    fprintf(stderr, "%ld tokens, checksum %016lx, %.1f ms\n", Count, Sum, Elapsed.count());
+    return 0;
+}
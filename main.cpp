@@ -2,235 +2,718 @@
 #include <cstdlib>
 #include <memory>
 #include <cstdarg>
-
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <csignal>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/Analysis/TargetFolder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemAlloc.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/TargetParser/Host.h"
+
+#include "codingparser.h"
+#include "lexer.h"
+#include "symbol_table.h"
 
 using namespace std;
 using namespace llvm;
 
-#define NUMBER 256
-#define IF 258
-#define ELSE 259
-#define WHILE 260
+// How the IRBuilder treats instructions whose operands are all constants:
+// NoFolder emits them as written, ConstantFolder and TargetFolder (which
+// also uses the module's DataLayout) collapse them while IR is built.
+enum class FoldMode { None, Constant, Target };
+
+// Everything one compilation works on after parsing: its options, the symbols
+// the lexer interned for it and the module being generated. ./main has one for
+// the whole run; the library creates one per compile(), which the returned
+// CompilationUnit keeps, so compiles share nothing.
+struct CompilationContext {
+    FoldMode Folding = FoldMode::None;
+
+    // -O0 (the default) emits the IR as built, apart from promoting variables
+    // to registers; the other levels run the matching PassBuilder default
+    // pipeline before the module is written.
+    OptimizationLevel OptLevel = OptimizationLevel::O0;
+
+    // The target, owned by main() or by a Compiler. main() only creates one
+    // when native code is emitted or a CPU is chosen. The module then carries
+    // its triple and DataLayout, and the optimizer is tuned for it.
+    TargetMachine *TheTargetMachine = nullptr;
+
+    SymbolTable Symbols;
+
+    unique_ptr<LLVMContext> TheContext;
+    // IRBuilderBase has no virtual destructor; a shared_ptr made for the
+    // concrete IRBuilder deletes it as what it is.
+    shared_ptr<IRBuilderBase> Builder;
+    unique_ptr<Module> TheModule;
+
+    // The stack slot of each variable declared in main(), indexed by symbol
+    // ID. Nothing in the language lets a variable escape main(), so none of
+    // them are globals.
+    vector<Value *> VariableSlots;
+
+    // Set while a hot loop is compiled for --tiered: variables then live in
+    // the interpreter's array that this argument points to, not in allocas.
+    Argument *VariableFrame = nullptr;
+
+    // Errors found after parsing. ./main sets EchoErrors and has them printed
+    // as they are found instead.
+    vector<Diagnostic> Diagnostics;
+    bool EchoErrors = false;
+};
+
+namespace {
+
+// The compilation in progress on this thread.
+static thread_local CompilationContext *Comp;
+
+// Makes C the compilation in progress for the enclosing scope.
+class ActiveCompilation {
+    CompilationContext *Saved;
+
+public:
+    ActiveCompilation(CompilationContext &C) : Saved(Comp) { Comp = &C; }
+    ~ActiveCompilation() { Comp = Saved; }
+};
+
+// Records an error that has no position in the source, such as an unknown
+// variable found by codegen, or prints it as "Error: <message>" for ./main.
+static void ReportError(const char *Fmt, ...)
+{
+    va_list Args, Copy;
+    va_start(Args, Fmt);
+    va_copy(Copy, Args);
+    string Message(vsnprintf(nullptr, 0, Fmt, Copy), '\0');
+    va_end(Copy);
+    vsnprintf(&Message[0], Message.size() + 1, Fmt, Args);
+    va_end(Args);
+    if (Comp->EchoErrors)
+        fprintf(stderr, "Error: %s\n", Message.c_str());
+    else
+        Comp->Diagnostics.push_back({Diagnostic::NoOffset, std::move(Message)});
+}
+
+// Diagnostic output. Everything is off by default, so a normal compile does
+// no I/O beyond reading the input and writing output.ll; --quiet turns off
+// whatever else was asked for. Only ./main sets these.
+static struct TraceOptions {
+    bool DumpAST = false;
+    bool DumpIR = false;
+    bool IRStats = false;
+    bool Time = false;
+    bool ArenaStats = false;
+    bool TimePasses = false;
+} Trace;
+
+//===----------------------------------------------------------------------===//
+// Phase timing
+//===----------------------------------------------------------------------===//
+
+// Reports the wall time of the enclosing scope on stderr when --time is given,
+// so lexing, parsing and code generation can be measured separately.
+class PhaseTimer {
+    const char *Name;
+    chrono::steady_clock::time_point Start;
+
+public:
+    PhaseTimer(const char *Name) : Name(Name), Start(chrono::steady_clock::now()) {}
+
+    ~PhaseTimer() {
+        if (!Trace.Time) return;
+        chrono::duration<double, milli> Elapsed = chrono::steady_clock::now() - Start;
+        fprintf(stderr, "%-8s %10.3f ms\n", Name, Elapsed.count());
+    }
+};
+
+//===----------------------------------------------------------------------===//
+// Optimization
+//===----------------------------------------------------------------------===//
+static void OptimizeModule(Module &M, OptimizationLevel Level)
+{
+    PassInstrumentationCallbacks PIC;
+    TimePassesHandler TimePasses(Trace.TimePasses);
+    TimePasses.registerCallbacks(PIC);
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(Comp->TheTargetMachine, PipelineTuningOptions(), std::nullopt, &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // Variables are stack slots until mem2reg runs; at -O1 and up SROA in the
+    // default pipeline does it.
+    ModulePassManager MPM;
+    if (Level == OptimizationLevel::O0)
+        MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
+    else
+        MPM = PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+
+    TimePasses.print();
+}
 
-static unique_ptr<LLVMContext> TheContext;
-static unique_ptr<IRBuilder<NoFolder>> Builder;
-static unique_ptr<Module> TheModule;
 
 static void InitializeModule()
 {
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("MyModule", *TheContext);
-    Builder = std::make_unique<IRBuilder<NoFolder>>(*TheContext);
+    Comp->TheContext = std::make_unique<LLVMContext>();
+    Comp->TheModule = std::make_unique<Module>("MyModule", *Comp->TheContext);
+    if (Comp->TheTargetMachine) {
+        Comp->TheModule->setTargetTriple(Comp->TheTargetMachine->getTargetTriple().str());
+        Comp->TheModule->setDataLayout(Comp->TheTargetMachine->createDataLayout());
+    }
+    switch (Comp->Folding) {
+        case FoldMode::None:
+            Comp->Builder = std::make_shared<IRBuilder<NoFolder>>(*Comp->TheContext);
+            break;
+        case FoldMode::Constant:
+            Comp->Builder = std::make_shared<IRBuilder<ConstantFolder>>(*Comp->TheContext);
+            break;
+        case FoldMode::Target:
+            Comp->Builder = std::make_shared<IRBuilder<TargetFolder>>(*Comp->TheContext, TargetFolder(Comp->TheModule->getDataLayout()));
+            break;
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Code generation helpers
+//
+// IR lowering shared by the AST classes and the flat AST; callers pass the
+// code generation of the operands in as callbacks.
+//===----------------------------------------------------------------------===//
+// A folding builder would turn a constant division by zero or INT_MIN / -1
+// into poison; emitting those unfolded keeps the run-time trap that the
+// program has without folding.
+static bool IsTrappingDivision(Value *Left, Value *Right)
+{
+    auto *L = dyn_cast<ConstantInt>(Left);
+    auto *R = dyn_cast<ConstantInt>(Right);
+    if (!L || !R) return false;
+    return R->isZero() || (L->isMinValue(true) && R->isMinusOne());
+}
+
+static Value *EmitBinaryOp(char Op, Value *Left, Value *Right)
+{
+    if ((Op == '/' || Op == '%') && Comp->Folding != FoldMode::None && IsTrappingDivision(Left, Right)) {
+        auto Opcode = Op == '/' ? Instruction::SDiv : Instruction::SRem;
+        return Comp->Builder->Insert(BinaryOperator::Create(Opcode, Left, Right), Op == '/' ? "divtmp" : "modtmp");
+    }
+
+    switch (Op) {
+        case '+':
+            return Comp->Builder->CreateAdd(Left, Right, "addtmp");
+        case '-':
+            return Comp->Builder->CreateSub(Left, Right, "subtmp");
+        case '*':
+            return Comp->Builder->CreateMul(Left, Right, "multmp");
+        case '/':
+            return Comp->Builder->CreateSDiv(Left, Right, "divtmp");
+        case '%':
+            return Comp->Builder->CreateSRem(Left, Right, "modtmp");
+        default:
+            ReportError("Invalid binary operator %c", Op);
+            return nullptr;
+    }
+}
+
+static Value *EmitIf(function_ref<Value *()> GenCond, function_ref<Value *()> GenThen,
+                     function_ref<Value *()> GenElse)
+{
+    Value *CondV = GenCond();
+    if (!CondV) return nullptr;
+
+    Function *TheFunction = Comp->Builder->GetInsertBlock()->getParent();
+
+    BasicBlock *ThenBB = BasicBlock::Create(*Comp->TheContext, "then");
+    BasicBlock *ElseBB = BasicBlock::Create(*Comp->TheContext, "else");
+    BasicBlock *MergeBB = BasicBlock::Create(*Comp->TheContext, "merge");
+
+    CondV = Comp->Builder->CreateICmpNE(CondV, ConstantInt::get(*Comp->TheContext, APInt(32, 0, true)), "ifcond");
+    Comp->Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+    TheFunction->insert(TheFunction->end(), ThenBB);
+    Comp->Builder->SetInsertPoint(ThenBB);
+    Value *ThenV = GenThen();
+    if (!ThenV) return nullptr;
+    Comp->Builder->CreateBr(MergeBB);
+    ThenBB = Comp->Builder->GetInsertBlock();
+
+    TheFunction->insert(TheFunction->end(), ElseBB);
+    Comp->Builder->SetInsertPoint(ElseBB);
+    Value *ElseV = GenElse();
+    if (!ElseV) return nullptr;
+    Comp->Builder->CreateBr(MergeBB);
+    ElseBB = Comp->Builder->GetInsertBlock();
+
+    TheFunction->insert(TheFunction->end(), MergeBB);
+    Comp->Builder->SetInsertPoint(MergeBB);
+
+    PHINode *PN = Comp->Builder->CreatePHI(Type::getInt32Ty(*Comp->TheContext), 2, "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+
+    return PN;
+}
+
+// The loop is laid out the way LLVM's loop passes expect: the header
+// re-evaluates the condition every iteration, and the body falls into a
+// latch whose back edge carries the loop's llvm.loop ID, which passes such as
+// the vectorizer and the unroller annotate. A while evaluates to 0.
+static Value *EmitWhile(function_ref<Value *()> GenCond, function_ref<Value *()> GenBody)
+{
+    Function *TheFunction = Comp->Builder->GetInsertBlock()->getParent();
+    BasicBlock *CondBB = BasicBlock::Create(*Comp->TheContext, "while.cond", TheFunction);
+    BasicBlock *BodyBB = BasicBlock::Create(*Comp->TheContext, "while.body");
+    BasicBlock *LatchBB = BasicBlock::Create(*Comp->TheContext, "while.latch");
+    BasicBlock *EndBB = BasicBlock::Create(*Comp->TheContext, "while.end");
+
+    Comp->Builder->CreateBr(CondBB);
+    Comp->Builder->SetInsertPoint(CondBB);
+    Value *CondV = GenCond();
+    if (!CondV) return nullptr;
+    CondV = Comp->Builder->CreateICmpNE(CondV, ConstantInt::get(*Comp->TheContext, APInt(32, 0, true)), "whilecond");
+    Comp->Builder->CreateCondBr(CondV, BodyBB, EndBB);
+
+    TheFunction->insert(TheFunction->end(), BodyBB);
+    Comp->Builder->SetInsertPoint(BodyBB);
+    if (!GenBody()) return nullptr;
+    Comp->Builder->CreateBr(LatchBB);
+
+    TheFunction->insert(TheFunction->end(), LatchBB);
+    Comp->Builder->SetInsertPoint(LatchBB);
+    BranchInst *BackEdge = Comp->Builder->CreateBr(CondBB);
+    MDNode *LoopID = MDNode::getDistinct(*Comp->TheContext, {nullptr});
+    LoopID->replaceOperandWith(0, LoopID);
+    BackEdge->setMetadata(LLVMContext::MD_loop, LoopID);
+
+    TheFunction->insert(TheFunction->end(), EndBB);
+    Comp->Builder->SetInsertPoint(EndBB);
+
+    return ConstantInt::get(Type::getInt32Ty(*Comp->TheContext), 0);
+}
+
+// Variables get an i32 stack slot at the top of main()'s entry block, where
+// mem2reg and SROA promote them to registers, loops included. The slot is
+// zeroed there too, so a declaration starts the variable at 0 once, however
+// often it is executed.
+static AllocaInst *CreateEntryBlockAlloca(uint32_t Sym)
+{
+    Function *F = Comp->Builder->GetInsertBlock()->getParent();
+    BasicBlock &Entry = F->getEntryBlock();
+    IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+    AllocaInst *Slot = EntryBuilder.CreateAlloca(Type::getInt32Ty(*Comp->TheContext), nullptr, Comp->Symbols.name(Sym));
+    EntryBuilder.CreateStore(ConstantInt::get(Type::getInt32Ty(*Comp->TheContext), 0), Slot);
+    return Slot;
+}
+
+// In a compiled hot loop every variable already exists, in the interpreter's
+// array, and keeps its value; the slot is its element of that array.
+static Value *VariableSlot(uint32_t Sym)
+{
+    if (!Comp->VariableSlots[Sym] && Comp->VariableFrame) {
+        BasicBlock &Entry = Comp->VariableFrame->getParent()->getEntryBlock();
+        IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+        Comp->VariableSlots[Sym] = EntryBuilder.CreateConstInBoundsGEP1_32(Type::getInt32Ty(*Comp->TheContext), Comp->VariableFrame, Sym,
+                                                                     Comp->Symbols.name(Sym));
+    }
+    return Comp->VariableSlots[Sym];
+}
+
+static Value *EmitVariableRead(uint32_t Sym)
+{
+    Value *Slot = VariableSlot(Sym);
+    if (!Slot) {
+        ReportError("Unknown variable %s", Comp->Symbols.name(Sym));
+        return nullptr;
+    }
+    return Comp->Builder->CreateLoad(Type::getInt32Ty(*Comp->TheContext), Slot, Comp->Symbols.name(Sym));
+}
+
+// A declaration evaluates to the variable's initial value, 0.
+static Value *EmitVariableDeclaration(uint32_t Sym)
+{
+    if (!VariableSlot(Sym)) Comp->VariableSlots[Sym] = CreateEntryBlockAlloca(Sym);
+    return ConstantInt::get(Type::getInt32Ty(*Comp->TheContext), 0);
+}
+
+// An assignment evaluates to the assigned value.
+static Value *EmitVariableAssign(uint32_t Sym, Value *Val)
+{
+    Value *Slot = VariableSlot(Sym);
+    if (!Slot) {
+        ReportError("Unknown variable %s", Comp->Symbols.name(Sym));
+        return nullptr;
+    }
+
+    Comp->Builder->CreateStore(Val, Slot);
+    return Val;
+}
+
+//===----------------------------------------------------------------------===//
+// Constant evaluation
+//===----------------------------------------------------------------------===//
+
+// Evaluates Op on two i32 constants exactly as the generated add/sub/mul/
+// sdiv/srem would: arithmetic wraps, and division or remainder by zero or of
+// INT_MIN by -1 are left for run time, where they trap.
+static bool EvalBinaryOp(char Op, int32_t L, int32_t R, int32_t &Result)
+{
+    switch (Op) {
+        case '+':
+            Result = (int32_t)((uint32_t)L + (uint32_t)R);
+            return true;
+        case '-':
+            Result = (int32_t)((uint32_t)L - (uint32_t)R);
+            return true;
+        case '*':
+            Result = (int32_t)((uint32_t)L * (uint32_t)R);
+            return true;
+        case '/':
+        case '%':
+            if (R == 0 || (L == INT32_MIN && R == -1)) return false;
+            Result = Op == '/' ? L / R : L % R;
+            return true;
+        default:
+            return false;
+    }
 }
 
 //===----------------------------------------------------------------------===//
 // AST nodes
 //===----------------------------------------------------------------------===//
+enum class ASTKind : uint8_t {
+    Block,
+    Number,
+    VariableRead,
+    VariableDeclaration,
+    VariableAssign,
+    BinaryExpr,
+    IfStatement,
+    WhileStatement,
+};
+
+static const size_t NumASTKinds = (size_t)ASTKind::WhileStatement + 1;
+
+static const char *ASTKindNames[NumASTKinds] = {
+    "Block", "Number", "VariableRead", "VariableDeclaration",
+    "VariableAssign", "BinaryExpr", "IfStatement", "WhileStatement",
+};
+
+// Nodes live in an ASTArena and are released with it, never deleted one by
+// one, so the destructor is deliberately not virtual: nodes that only hold
+// child pointers stay trivially destructible and cost nothing to free.
 class GenericASTNode
 {
+    const ASTKind Kind;
+
+protected:
+    GenericASTNode(ASTKind Kind) : Kind(Kind) {}
+    ~GenericASTNode() = default;
+
 public:
-    virtual ~GenericASTNode() = default;
+    ASTKind getKind() const { return Kind; }
     virtual void toString(){};
     virtual Value *codegen() = 0;
+
+    // Evaluates constant subexpressions in place and returns the node that
+    // should replace this one (--const-eval).
+    virtual GenericASTNode *foldConstants() { return this; }
 };
 
-class StatementASTNode : public GenericASTNode {
-    unique_ptr<GenericASTNode> node;
-    unique_ptr<GenericASTNode> nextNode;
+// A list of statements, stored as one contiguous array in the AST arena. A
+// block evaluates to 0, or to its last statement's value if YieldsLast is set
+// (the declaration and assignment a first assignment expands to).
+class BlockASTNode : public GenericASTNode {
+    GenericASTNode **Stmts;
+    uint32_t Count;
+    bool YieldsLast;
 
 public:
-    StatementASTNode(unique_ptr<GenericASTNode> node, unique_ptr<GenericASTNode> nextNode = nullptr)
-        : node(std::move(node)), nextNode(std::move(nextNode)) {}
+    BlockASTNode(GenericASTNode **Stmts, uint32_t Count, bool YieldsLast = false)
+        : GenericASTNode(ASTKind::Block), Stmts(Stmts), Count(Count), YieldsLast(YieldsLast) {}
 
-    void setNextNode(unique_ptr<GenericASTNode> next) {
-        nextNode = std::move(next);
-    }
-
-    GenericASTNode* getNextNode() const {
-        return nextNode.get();
-    }
+    uint32_t size() const { return Count; }
+    GenericASTNode *operator[](uint32_t i) const { return Stmts[i]; }
+    GenericASTNode **begin() const { return Stmts; }
+    GenericASTNode **end() const { return Stmts + Count; }
+    bool yieldsLast() const { return YieldsLast; }
 
     void toString() override {
-        printf("Statement:\n");
-        node->toString();
-        if (nextNode) {
-            printf("\nNext Statement:\n");
-            nextNode->toString();
+        for (uint32_t i = 0; i < Count; ++i) {
+            if (i) printf("\nNext Statement:\n");
+            if (!YieldsLast || i + 1 < Count) printf("Statement:\n");
+            Stmts[i]->toString();
         }
     }
 
     Value *codegen() override {
-        if (!node->codegen()) return nullptr;
-        if (nextNode) return nextNode->codegen();
-        return ConstantInt::get(*TheContext, APInt(32, 0));
+        Value *Last = nullptr;
+        for (GenericASTNode *S : *this)
+            if (!(Last = S->codegen())) return nullptr;
+        return YieldsLast ? Last : ConstantInt::get(*Comp->TheContext, APInt(32, 0));
     }
-};
-
 
+    GenericASTNode *foldConstants() override {
+        for (GenericASTNode *&S : *this) S = S->foldConstants();
+        return this;
+    }
+};
 
 class NumberASTNode : public GenericASTNode
 {
     int Val;
  
 public:
-    NumberASTNode(int Val)
+    NumberASTNode(int Val) : GenericASTNode(ASTKind::Number)
     {
         this->Val = Val;
     }
+    int getVal() const { return Val; }
+    void setVal(int Val) { this->Val = Val; }
     void toString()
     {
         printf("Number: %d", this->Val);
     }
     Value *codegen()
     {
-        return ConstantInt::get(*TheContext, APInt(32, this->Val, true));
+        return ConstantInt::get(*Comp->TheContext, APInt(32, this->Val, true));
     }
 };
 
 class VariableReadASTNode : public GenericASTNode {
-    string name;
+    uint32_t sym;
 
 public:
-    VariableReadASTNode(const string &name) : name(name) {}
+    VariableReadASTNode(uint32_t sym) : GenericASTNode(ASTKind::VariableRead), sym(sym) {}
+
+    uint32_t getSym() const { return sym; }
 
     void toString() override {
-        printf("Variable Read: %s", name.c_str());
+        printf("Variable Read: %s", Comp->Symbols.name(sym));
     }
 
     Value *codegen() override {
-        Value *V = TheModule->getNamedGlobal(name);
-        if (!V) {
-            fprintf(stderr, "Error: Unknown variable %s\n", name.c_str());
-            return nullptr;
-        }
-        return Builder->CreateLoad(Type::getInt32Ty(*TheContext), V, name.c_str());
+        return EmitVariableRead(sym);
     }
 };
 
 
 class VariableDeclarationASTNode : public GenericASTNode {
-    string name;
+    uint32_t sym;
 
 public:
-    VariableDeclarationASTNode(const string &name) : name(name) {}
+    VariableDeclarationASTNode(uint32_t sym) : GenericASTNode(ASTKind::VariableDeclaration), sym(sym) {}
+
+    uint32_t getSym() const { return sym; }
 
     void toString() override {
-        printf("Variable Declaration: %s", name.c_str());
+        printf("Variable Declaration: %s", Comp->Symbols.name(sym));
     }
 
     Value *codegen() override {
-        Constant *InitVal = ConstantInt::get(Type::getInt32Ty(*TheContext), 0);
-        GlobalVariable *GV = new GlobalVariable(
-            *TheModule,                          
-            Type::getInt32Ty(*TheContext),       
-            false,                               
-            GlobalValue::ExternalLinkage,        
-            InitVal,                             
-            "varName"                            
-        );
-
-        return GV;
+        return EmitVariableDeclaration(sym);
     }
 };
 
 
 class VariableAssignASTNode : public GenericASTNode {
-    string varName;
-    unique_ptr<GenericASTNode> value;
+    uint32_t varSym;
+    GenericASTNode *value;
 
 public:
-    VariableAssignASTNode(const string &varName, unique_ptr<GenericASTNode> value)
-        : varName(varName), value(std::move(value)) {}
+    VariableAssignASTNode(uint32_t varSym, GenericASTNode *value)
+        : GenericASTNode(ASTKind::VariableAssign), varSym(varSym), value(value) {}
+
+    uint32_t getVarSym() const { return varSym; }
+    GenericASTNode *getValue() const { return value; }
 
     void toString() override {
-        printf("Variable Assign: %s = ", varName.c_str());
+        printf("Variable Assign: %s = ", Comp->Symbols.name(varSym));
         value->toString();
     }
 
     Value *codegen() override {
         Value *Val = value->codegen();
         if (!Val) return nullptr;
+        return EmitVariableAssign(varSym, Val);
+    }
 
-        Value *V = TheModule->getNamedGlobal(varName);
-        if (!V) {
-            fprintf(stderr, "Error: Unknown variable %s\n", varName.c_str());
-            return nullptr;
-        }
-
-        return Builder->CreateStore(Val, V);
+    GenericASTNode *foldConstants() override {
+        value = value->foldConstants();
+        return this;
     }
 };
 
 class BinaryExprAST : public GenericASTNode
 {
     char Op;
-    unique_ptr<GenericASTNode> LHS, RHS;
+    GenericASTNode *LHS, *RHS;
  
 public:
-    BinaryExprAST(char Op, unique_ptr<GenericASTNode> LHS, unique_ptr<GenericASTNode> RHS)
+    BinaryExprAST(char Op, GenericASTNode *LHS, GenericASTNode *RHS) : GenericASTNode(ASTKind::BinaryExpr)
     {
         this->Op = Op;
-        this->LHS = std::move(LHS);
-        this->RHS = std::move(RHS);
-    }
- 
-    void toString() {
-        printf("BinaryExpr: %c\n", this->Op);
-        printf("LHS: ");
-        this->LHS->toString();
-        printf("\nRHS: ");
-        this->RHS->toString();
-        printf("\n");
+        this->LHS = LHS;
+        this->RHS = RHS;
     }
-   
-    Value* codegen() {
-        Value *Left = LHS->codegen();
-        Value *Right = RHS->codegen();
-        if (!Left || !Right) {
-            return nullptr;
+
+    char getOp() const { return Op; }
+    GenericASTNode *getLHS() const { return LHS; }
+    GenericASTNode *getRHS() const { return RHS; }
+
+    // Work list for walk(); each entry is a node and whether its operands
+    // have been visited.
+    typedef vector<pair<GenericASTNode *, bool>> WalkStack;
+
+    // Visits the operator tree below Root in post-order with an explicit
+    // stack, so a chain of a million operators needs no native stack: Enter(E)
+    // runs before E's operands, Leaf(N) for every operand that is not itself
+    // an operator, left to right, and Exit(E) once both operands of E are
+    // done. Work may be shared by nested walks.
+    template <typename EnterFn, typename LeafFn, typename ExitFn>
+    static void walk(BinaryExprAST *Root, WalkStack &Work, EnterFn Enter, LeafFn Leaf, ExitFn Exit) {
+        size_t Base = Work.size();
+        Work.push_back({Root, false});
+        while (Work.size() > Base) {
+            auto [N, Done] = Work.back();
+            Work.pop_back();
+            if (N->getKind() != ASTKind::BinaryExpr) {
+                Leaf(N);
+                continue;
+            }
+            auto *E = static_cast<BinaryExprAST *>(N);
+            if (Done) {
+                Exit(E);
+                continue;
+            }
+            Enter(E);
+            Work.push_back({E, true});
+            Work.push_back({E->RHS, false});
+            Work.push_back({E->LHS, false});
         }
- 
-        switch (Op) {
-            case '+':
-                return Builder->CreateAdd(Left, Right, "addtmp");
-            case '-':
-                return Builder->CreateSub(Left, Right, "subtmp");
-            case '*':
-                return Builder->CreateMul(Left, Right, "multmp");
-            case '/':
-                return Builder->CreateSDiv(Left, Right, "divtmp");
-            case '%':
-                return Builder->CreateSRem(Left, Right, "modtmp");
-            default:
-                fprintf(stderr, "Invalid binary operator %c\n", Op);
-                return nullptr;
+    }
+
+    void toString() override {
+        // Pending output is either a node or a piece of text.
+        vector<pair<GenericASTNode *, const char *>> Work{{this, nullptr}};
+        while (!Work.empty()) {
+            auto [N, Text] = Work.back();
+            Work.pop_back();
+            if (Text) {
+                printf("%s", Text);
+            } else if (N->getKind() != ASTKind::BinaryExpr) {
+                N->toString();
+            } else {
+                auto *E = static_cast<BinaryExprAST *>(N);
+                printf("BinaryExpr: %c\n", E->Op);
+                printf("LHS: ");
+                Work.push_back({nullptr, "\n"});
+                Work.push_back({E->RHS, nullptr});
+                Work.push_back({nullptr, "\nRHS: "});
+                Work.push_back({E->LHS, nullptr});
+            }
         }
     }
+
+    // Both operands are generated even if the first fails, as before.
+    Value *codegen() override {
+        WalkStack Work;
+        vector<Value *> Values;
+        walk(this, Work, [](BinaryExprAST *) {},
+             [&](GenericASTNode *N) { Values.push_back(N->codegen()); },
+             [&](BinaryExprAST *E) {
+                 Value *Right = Values.back();
+                 Values.pop_back();
+                 Value *&Left = Values.back();
+                 Left = Left && Right ? EmitBinaryOp(E->Op, Left, Right) : nullptr;
+             });
+        return Values.back();
+    }
+
+    GenericASTNode *foldConstants() override {
+        WalkStack Work;
+        vector<GenericASTNode *> Folded;
+        walk(this, Work, [](BinaryExprAST *) {},
+             [&](GenericASTNode *N) { Folded.push_back(N->foldConstants()); },
+             [&](BinaryExprAST *E) {
+                 E->RHS = Folded.back();
+                 Folded.pop_back();
+                 E->LHS = Folded.back();
+                 Folded.back() = E->foldOperands();
+             });
+        return Folded.back();
+    }
+
+private:
+    // Folds this operator once its operands are folded. The left literal is
+    // reused for the result.
+    GenericASTNode *foldOperands() {
+        if (LHS->getKind() != ASTKind::Number || RHS->getKind() != ASTKind::Number) return this;
+
+        auto *L = static_cast<NumberASTNode *>(LHS);
+        int32_t Result;
+        if (!EvalBinaryOp(Op, L->getVal(), static_cast<NumberASTNode *>(RHS)->getVal(), Result)) return this;
+        L->setVal(Result);
+        return L;
+    }
 };
 
+// Whether N contains a variable declaration. Folding must not drop one, even
+// in code that never runs: the first assignment to a name declares it for
+// everything after it in tree order.
+static bool DeclaresVariables(GenericASTNode *N);
+
 class IfStatementAST : public GenericASTNode {
-    unique_ptr<GenericASTNode> Cond, TrueExpr, FalseExpr;
+    GenericASTNode *Cond, *TrueExpr, *FalseExpr;
 
 public:
+    // The parser supplies a literal 0 when there is no else branch.
     IfStatementAST(
-        unique_ptr<GenericASTNode> Cond,
-        unique_ptr<GenericASTNode> TrueExpr,
-        unique_ptr<GenericASTNode> FalseExpr
-    )
+        GenericASTNode *Cond,
+        GenericASTNode *TrueExpr,
+        GenericASTNode *FalseExpr
+    ) : GenericASTNode(ASTKind::IfStatement)
     {
-        this->Cond = std::move(Cond);
-        this->TrueExpr = std::move(TrueExpr);
-        this->FalseExpr = std::move(FalseExpr);
-        
-        if (this->FalseExpr == nullptr){
-            this->FalseExpr = std::make_unique<NumberASTNode>(0);
-        }
+        this->Cond = Cond;
+        this->TrueExpr = TrueExpr;
+        this->FalseExpr = FalseExpr;
     }
 
+    GenericASTNode *getCond() const { return Cond; }
+    GenericASTNode *getTrueExpr() const { return TrueExpr; }
+    GenericASTNode *getFalseExpr() const { return FalseExpr; }
+
     void toString() override {
         printf("If Statement:\n");
         printf("Condition: ");
@@ -244,139 +727,997 @@ public:
     }
 
     Value *codegen() override {
-        Value *CondV = Cond->codegen();
-        if (!CondV) return nullptr;
+        return EmitIf([&] { return Cond->codegen(); },
+                      [&] { return TrueExpr->codegen(); },
+                      [&] { return FalseExpr->codegen(); });
+    }
+
+    // With a constant condition the if is replaced by the branch it takes.
+    GenericASTNode *foldConstants() override {
+        Cond = Cond->foldConstants();
+        TrueExpr = TrueExpr->foldConstants();
+        FalseExpr = FalseExpr->foldConstants();
+        if (Cond->getKind() != ASTKind::Number) return this;
+        GenericASTNode *Taken = static_cast<NumberASTNode *>(Cond)->getVal() ? TrueExpr : FalseExpr;
+        if (DeclaresVariables(Taken == TrueExpr ? FalseExpr : TrueExpr)) return this;
+        return Taken;
+    }
+};
 
-        Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-        BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then");
-        BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
-        BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "merge");
+// Reports what the verifier finds wrong with a generated function, if anything.
+static bool VerifyGenerated(Function &F)
+{
+    string Problems;
+    raw_string_ostream OS(Problems);
+    if (!verifyFunction(F, &OS)) return true;
+    ReportError("%s", OS.str().c_str());
+    return false;
+}
+
+// Builds main() around the generated body and optimizes it. Returns false if
+// the body could not be generated or main does not verify.
+static bool CodeGenTopLevel(function_ref<Value *()> GenBody)
+{
+    vector<Type *> ArgumentsTypes(0);
+    FunctionType *FT = FunctionType::get(Type::getInt32Ty(*Comp->TheContext), ArgumentsTypes, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, "main", Comp->TheModule.get());
+
+    BasicBlock *BB = BasicBlock::Create(*Comp->TheContext, "entry", F);
+    Comp->Builder->SetInsertPoint(BB);
+    Comp->VariableSlots.assign(Comp->Symbols.size(), nullptr);
+
+    bool Valid = false;
+    if (Value *RetVal = GenBody()) {
+        Comp->Builder->CreateRet(RetVal);
+
+        // The pipeline assumes valid IR; anything else is written as is.
+        Valid = VerifyGenerated(*F);
+        if (Valid) {
+            PhaseTimer Timer("optimize");
+            OptimizeModule(*Comp->TheModule, Comp->OptLevel);
+        }
+    }
+
+    if (Trace.DumpIR) {
+        raw_fd_ostream Dump(STDERR_FILENO, false);
+        Comp->TheModule->print(Dump, nullptr);
+    }
+    if (Trace.IRStats)
+        fprintf(stderr, "IR: %u instructions in %zu basic blocks\n", F->getInstructionCount(), F->size());
+    return Valid;
+}
 
-        CondV = Builder->CreateICmpNE(CondV, ConstantInt::get(*TheContext, APInt(32, 0, true)), "ifcond");
-        Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+class WhileStatementAST : public GenericASTNode {
+    GenericASTNode *Cond;
+    GenericASTNode *Body;
 
-        TheFunction->insert(TheFunction->end(), ThenBB);
-        Builder->SetInsertPoint(ThenBB);
-        Value *ThenV = TrueExpr->codegen();
-        if (!ThenV) return nullptr;
-        Builder->CreateBr(MergeBB);
-        ThenBB = Builder->GetInsertBlock();
+public:
+    WhileStatementAST(GenericASTNode *Cond, GenericASTNode *Body)
+        : GenericASTNode(ASTKind::WhileStatement), Cond(Cond), Body(Body) {}
 
-        TheFunction->insert(TheFunction->end(), ElseBB);
-        Builder->SetInsertPoint(ElseBB);
-        Value *ElseV = FalseExpr ? FalseExpr->codegen() : nullptr;
-        Builder->CreateBr(MergeBB);
-        ElseBB = Builder->GetInsertBlock();
+    GenericASTNode *getCond() const { return Cond; }
+    GenericASTNode *getBody() const { return Body; }
 
-        TheFunction->insert(TheFunction->end(), MergeBB);
-        Builder->SetInsertPoint(MergeBB);
+    void toString() override {
+        printf("While Statement:\n");
+        printf("Condition: ");
+        Cond->toString();
+        printf("\nBody: ");
+        Body->toString();
+    }
 
-        PHINode *PN = Builder->CreatePHI(Type::getInt32Ty(*TheContext), 2, "iftmp");
-        PN->addIncoming(ThenV, ThenBB);
-        if (FalseExpr) PN->addIncoming(ElseV, ElseBB);
+    Value *codegen() override {
+        return EmitWhile([&] { return Cond->codegen(); },
+                         [&] { return Body->codegen(); });
+    }
 
-        return PN;
+    // A loop whose condition is constant 0 never runs and yields 0, which is
+    // the condition literal itself.
+    GenericASTNode *foldConstants() override {
+        Cond = Cond->foldConstants();
+        Body = Body->foldConstants();
+        if (Cond->getKind() != ASTKind::Number || static_cast<NumberASTNode *>(Cond)->getVal() != 0) return this;
+        return DeclaresVariables(Body) ? this : Cond;
     }
-};
 
+};
 
-void CodeGenTopLevel(unique_ptr<GenericASTNode> AST_Root)
+static bool DeclaresVariables(GenericASTNode *N)
 {
-    vector<Type *> ArgumentsTypes(0);
-    FunctionType *FT = FunctionType::get(Type::getInt32Ty(*TheContext), ArgumentsTypes, false);
-    Function *F = Function::Create(FT, Function::ExternalLinkage, "main", TheModule.get());
+    switch (N->getKind()) {
+        case ASTKind::VariableDeclaration:
+            return true;
+        case ASTKind::Block:
+            for (GenericASTNode *S : *static_cast<BlockASTNode *>(N))
+                if (DeclaresVariables(S)) return true;
+            return false;
+        case ASTKind::IfStatement: {
+            auto *I = static_cast<IfStatementAST *>(N);
+            return DeclaresVariables(I->getTrueExpr()) || DeclaresVariables(I->getFalseExpr());
+        }
+        case ASTKind::WhileStatement:
+            return DeclaresVariables(static_cast<WhileStatementAST *>(N)->getBody());
+        default:
+            // Expressions, and the values assigned, declare nothing.
+            return false;
+    }
+}
+
 
-    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
-    Builder->SetInsertPoint(BB);
+//===----------------------------------------------------------------------===//
+// Flat AST
+//===----------------------------------------------------------------------===//
 
-    if (Value *RetVal = AST_Root->codegen()) {
-        Builder->CreateRet(RetVal);
+// Index-based copy of the AST in parallel arrays, used instead of the node
+// classes with --flat-ast. Nodes are stored in post-order, so each subtree is
+// the contiguous range [First[i], i] and operands precede their operator: a
+// pure expression is generated by one forward loop over its range, and only
+// statements, ifs and whiles take a switch-dispatched walk.
+// The copy is lowered from the finished pointer tree after parsing, so that
+// tree is still built and allocated: --flat-ast changes how code is generated
+// (and adds the lowering), not how the program is parsed.
+class FlatAST {
+public:
+    static constexpr uint32_t NoNode = UINT32_MAX;
+
+private:
+    // Children by kind: Block (offset of its statements in Lists, count),
+    // BinaryExpr (LHS, RHS), IfStatement (cond, then, else), WhileStatement
+    // (cond, body), VariableAssign (value). Values holds the literal of a
+    // Number, the symbol ID of the variable nodes and a Block's YieldsLast.
+    vector<ASTKind> Kinds;
+    vector<char> Ops;
+    vector<uint32_t> First;
+    vector<uint32_t> A, B, C;
+    vector<int32_t> Values;
+    vector<uint32_t> Lists;
+    uint32_t Root = NoNode;
+
+    vector<Value *> Scratch;
+
+    uint32_t add(ASTKind Kind, uint32_t Start, int32_t Val = 0, char Op = 0,
+                 uint32_t ChildA = NoNode, uint32_t ChildB = NoNode, uint32_t ChildC = NoNode) {
+        Kinds.push_back(Kind);
+        Ops.push_back(Op);
+        First.push_back(Start);
+        A.push_back(ChildA);
+        B.push_back(ChildB);
+        C.push_back(ChildC);
+        Values.push_back(Val);
+        return Kinds.size() - 1;
     }
 
-    auto Filename = "output.ll";
-    std::error_code EC;
-    raw_fd_ostream dest(Filename, EC);
+    // Operator trees are lowered with an explicit stack, so a deep
+    // expression does not recurse; Pending also collects a block's
+    // statements, which are only copied to Lists once nested blocks are done.
+    BinaryExprAST::WalkStack Work;
+    vector<uint32_t> Pending;
+
+    uint32_t lower(GenericASTNode *N) {
+        uint32_t Start = Kinds.size();
+        switch (N->getKind()) {
+            case ASTKind::Block: {
+                auto *Block = static_cast<BlockASTNode *>(N);
+                size_t Base = Pending.size();
+                for (GenericASTNode *S : *Block) {
+                    uint32_t Index = lower(S);
+                    Pending.push_back(Index);
+                }
+                uint32_t Offset = Lists.size();
+                Lists.insert(Lists.end(), Pending.begin() + Base, Pending.end());
+                Pending.resize(Base);
+                return add(ASTKind::Block, Start, Block->yieldsLast(), 0, Offset, Block->size());
+            }
+            case ASTKind::Number:
+                return add(ASTKind::Number, Start, static_cast<NumberASTNode *>(N)->getVal());
+            case ASTKind::VariableRead:
+                return add(ASTKind::VariableRead, Start, static_cast<VariableReadASTNode *>(N)->getSym());
+            case ASTKind::VariableDeclaration:
+                return add(ASTKind::VariableDeclaration, Start,
+                           static_cast<VariableDeclarationASTNode *>(N)->getSym());
+            case ASTKind::VariableAssign: {
+                auto *V = static_cast<VariableAssignASTNode *>(N);
+                uint32_t Value = lower(V->getValue());
+                return add(ASTKind::VariableAssign, Start, V->getVarSym(), 0, Value);
+            }
+            case ASTKind::BinaryExpr: {
+                // Pending holds each open operator's start, then its
+                // operands' indices as they are lowered.
+                BinaryExprAST::walk(
+                    static_cast<BinaryExprAST *>(N), Work,
+                    [&](BinaryExprAST *) { Pending.push_back(Kinds.size()); },
+                    [&](GenericASTNode *Leaf) {
+                        uint32_t Index = lower(Leaf);
+                        Pending.push_back(Index);
+                    },
+                    [&](BinaryExprAST *E) {
+                        uint32_t R = Pending.back();
+                        Pending.pop_back();
+                        uint32_t L = Pending.back();
+                        Pending.pop_back();
+                        Pending.back() = add(ASTKind::BinaryExpr, Pending.back(), 0, E->getOp(), L, R);
+                    });
+                uint32_t Index = Pending.back();
+                Pending.pop_back();
+                return Index;
+            }
+            case ASTKind::IfStatement: {
+                auto *I = static_cast<IfStatementAST *>(N);
+                uint32_t Cond = lower(I->getCond());
+                uint32_t Then = lower(I->getTrueExpr());
+                uint32_t Else = lower(I->getFalseExpr());
+                return add(ASTKind::IfStatement, Start, 0, 0, Cond, Then, Else);
+            }
+            case ASTKind::WhileStatement: {
+                auto *W = static_cast<WhileStatementAST *>(N);
+                uint32_t Cond = lower(W->getCond());
+                uint32_t Body = lower(W->getBody());
+                return add(ASTKind::WhileStatement, Start, 0, 0, Cond, Body);
+            }
+        }
+        return NoNode;
+    }
+
+    // Expressions contain only numbers, variable reads and operators, so their
+    // range is generated in order with each result kept in Scratch.
+    Value *codegenExpr(uint32_t N) {
+        uint32_t Begin = First[N];
+        Scratch.resize(N - Begin + 1);
+        for (uint32_t i = Begin; i <= N; ++i) {
+            Value *V = nullptr;
+            switch (Kinds[i]) {
+                case ASTKind::Number:
+                    V = ConstantInt::get(*Comp->TheContext, APInt(32, Values[i], true));
+                    break;
+                case ASTKind::VariableRead:
+                    V = EmitVariableRead(Values[i]);
+                    break;
+                case ASTKind::BinaryExpr: {
+                    Value *Left = Scratch[A[i] - Begin];
+                    Value *Right = Scratch[B[i] - Begin];
+                    if (Left && Right) V = EmitBinaryOp(Ops[i], Left, Right);
+                    break;
+                }
+                default:
+                    ReportError("Unexpected %s node in expression", ASTKindNames[(size_t)Kinds[i]]);
+                    break;
+            }
+            Scratch[i - Begin] = V;
+        }
+        return Scratch[N - Begin];
+    }
+
+    Value *codegen(uint32_t N) {
+        switch (Kinds[N]) {
+            case ASTKind::Block: {
+                Value *Last = nullptr;
+                for (uint32_t i = A[N]; i < A[N] + B[N]; ++i)
+                    if (!(Last = codegen(Lists[i]))) return nullptr;
+                return Values[N] ? Last : ConstantInt::get(*Comp->TheContext, APInt(32, 0));
+            }
+            case ASTKind::VariableDeclaration:
+                return EmitVariableDeclaration(Values[N]);
+            case ASTKind::VariableAssign: {
+                Value *Val = codegenExpr(A[N]);
+                if (!Val) return nullptr;
+                return EmitVariableAssign(Values[N], Val);
+            }
+            case ASTKind::IfStatement:
+                return EmitIf([&] { return codegen(A[N]); },
+                              [&] { return codegen(B[N]); },
+                              [&] { return codegen(C[N]); });
+            case ASTKind::WhileStatement:
+                return EmitWhile([&] { return codegen(A[N]); },
+                                 [&] { return codegen(B[N]); });
+            default:
+                return codegenExpr(N);
+        }
+    }
 
-    if (EC) {
-        errs() << "Could not open file: " << EC.message();
-        return;
+    // Same output as GenericASTNode::toString(), and like it without
+    // recursion through operator trees.
+    void print(uint32_t N) const {
+        switch (Kinds[N]) {
+            case ASTKind::Block:
+                for (uint32_t i = 0; i < B[N]; ++i) {
+                    if (i) printf("\nNext Statement:\n");
+                    if (!Values[N] || i + 1 < B[N]) printf("Statement:\n");
+                    print(Lists[A[N] + i]);
+                }
+                break;
+            case ASTKind::Number:
+                printf("Number: %d", Values[N]);
+                break;
+            case ASTKind::VariableRead:
+                printf("Variable Read: %s", Comp->Symbols.name(Values[N]));
+                break;
+            case ASTKind::VariableDeclaration:
+                printf("Variable Declaration: %s", Comp->Symbols.name(Values[N]));
+                break;
+            case ASTKind::VariableAssign:
+                printf("Variable Assign: %s = ", Comp->Symbols.name(Values[N]));
+                print(A[N]);
+                break;
+            case ASTKind::BinaryExpr: {
+                // Pending output is either a node or a piece of text.
+                vector<pair<uint32_t, const char *>> Work{{N, nullptr}};
+                while (!Work.empty()) {
+                    auto [I, Text] = Work.back();
+                    Work.pop_back();
+                    if (Text) {
+                        printf("%s", Text);
+                    } else if (Kinds[I] != ASTKind::BinaryExpr) {
+                        print(I);
+                    } else {
+                        printf("BinaryExpr: %c\n", Ops[I]);
+                        printf("LHS: ");
+                        Work.push_back({NoNode, "\n"});
+                        Work.push_back({B[I], nullptr});
+                        Work.push_back({NoNode, "\nRHS: "});
+                        Work.push_back({A[I], nullptr});
+                    }
+                }
+                break;
+            }
+            case ASTKind::IfStatement:
+                printf("If Statement:\n");
+                printf("Condition: ");
+                print(A[N]);
+                printf("\nTrue Branch: ");
+                print(B[N]);
+                printf("\nFalse Branch: ");
+                print(C[N]);
+                break;
+            case ASTKind::WhileStatement:
+                printf("While Statement:\n");
+                printf("Condition: ");
+                print(A[N]);
+                printf("\nBody: ");
+                print(B[N]);
+                break;
+        }
     }
 
-    F->print(errs());
-    F->print(dest);
-    F->eraseFromParent();
+public:
+    void build(GenericASTNode *AST) { Root = lower(AST); }
+
+    size_t size() const { return Kinds.size(); }
+    Value *codegen() { return codegen(Root); }
+    void print() const { print(Root); }
+};
+
+//===----------------------------------------------------------------------===//
+// Interpreter
+//===----------------------------------------------------------------------===//
+
+// Codegen rejects a variable used before any declaration of it in tree order.
+// The interpreter and the VM skip codegen, so they make the same walk, with the
+// same messages, before anything runs. Known is indexed by symbol ID.
+static bool KnownVariable(vector<bool> &Known, uint32_t Sym)
+{
+    if (Known[Sym]) return true;
+    ReportError("Unknown variable %s", Comp->Symbols.name(Sym));
+    return false;
 }
 
-class WhileStatementAST : public GenericASTNode {
-    unique_ptr<GenericASTNode> Cond;
-    unique_ptr<GenericASTNode> Body;
+static bool ResolveVariables(GenericASTNode *N, vector<bool> &Known)
+{
+    switch (N->getKind()) {
+        case ASTKind::Block:
+            for (GenericASTNode *S : *static_cast<BlockASTNode *>(N))
+                if (!ResolveVariables(S, Known)) return false;
+            return true;
+        case ASTKind::Number:
+            return true;
+        case ASTKind::VariableRead:
+            return KnownVariable(Known, static_cast<VariableReadASTNode *>(N)->getSym());
+        case ASTKind::VariableDeclaration:
+            Known[static_cast<VariableDeclarationASTNode *>(N)->getSym()] = true;
+            return true;
+        case ASTKind::VariableAssign: {
+            auto *V = static_cast<VariableAssignASTNode *>(N);
+            return ResolveVariables(V->getValue(), Known) && KnownVariable(Known, V->getVarSym());
+        }
+        case ASTKind::BinaryExpr: {
+            // Codegen generates both operands before giving up.
+            BinaryExprAST::WalkStack Work;
+            bool Ok = true;
+            BinaryExprAST::walk(static_cast<BinaryExprAST *>(N), Work, [](BinaryExprAST *) {},
+                                [&](GenericASTNode *Leaf) {
+                                    if (!ResolveVariables(Leaf, Known)) Ok = false;
+                                },
+                                [](BinaryExprAST *) {});
+            return Ok;
+        }
+        case ASTKind::IfStatement: {
+            auto *I = static_cast<IfStatementAST *>(N);
+            return ResolveVariables(I->getCond(), Known) && ResolveVariables(I->getTrueExpr(), Known) &&
+                   ResolveVariables(I->getFalseExpr(), Known);
+        }
+        case ASTKind::WhileStatement: {
+            auto *W = static_cast<WhileStatementAST *>(N);
+            return ResolveVariables(W->getCond(), Known) && ResolveVariables(W->getBody(), Known);
+        }
+    }
+    return false;
+}
+
+static bool ResolveVariables(GenericASTNode *AST)
+{
+    vector<bool> Known(Comp->Symbols.size(), false);
+    return ResolveVariables(AST, Known);
+}
+
+// --const-eval. Folding drops untaken branches and loops that never run, and
+// with them any read of an unknown variable that would have been rejected.
+// A program that does not resolve is therefore left unfolded, and fails
+// later exactly as it does without --const-eval. The check itself reports
+// nothing.
+static GenericASTNode *FoldConstants(GenericASTNode *AST)
+{
+    bool Echo = Comp->EchoErrors;
+    size_t NumDiagnostics = Comp->Diagnostics.size();
+    Comp->EchoErrors = false;
+    bool Resolves = ResolveVariables(AST);
+    Comp->EchoErrors = Echo;
+    Comp->Diagnostics.resize(NumDiagnostics);
+    return Resolves ? AST->foldConstants() : AST;
+}
+
+// A while loop compiled by --tiered. It runs the loop to completion on the
+// interpreter's variables and returns the loop's value.
+typedef int32_t (*LoopFunction)(int32_t *Vars);
+static LoopFunction CompileHotLoop(WhileStatementAST *Loop);
+
+// Evaluates the tree directly for --interpret, producing the value main()
+// would return without initializing LLVM at all. Dispatch is a switch on the
+// node's kind tag rather than a virtual call, and variables live in a vector
+// indexed by symbol ID. The semantics are those of the Emit* helpers:
+// arithmetic wraps, a YieldsLast block (the declaration and first assignment
+// of a variable) evaluates to its last statement while other statement lists
+// and loops evaluate to 0, and a division that traps in compiled code raises
+// SIGFPE here too.
+class Interpreter {
+    vector<int32_t> Vars;
+
+    // Operator trees are evaluated with these explicit stacks, shared by
+    // nested evaluations, instead of by recursion.
+    BinaryExprAST::WalkStack Work;
+    vector<int32_t> Operands;
+
+    // With --tiered, how often each loop's body has run. When that reaches
+    // TierThreshold the loop is compiled, and from then on it runs natively.
+    struct LoopState {
+        uint32_t Iterations = 0;
+        LoopFunction Native = nullptr;
+    };
+    uint32_t TierThreshold;
+    DenseMap<WhileStatementAST *, LoopState> Loops;
+
+    // A loop that gets hot switches to native code in the middle of a run:
+    // the compiled loop picks up at the next condition test with the
+    // variables as they are.
+    int32_t evalTiered(WhileStatementAST *W) {
+        for (;;) {
+            if (LoopFunction Native = Loops[W].Native) return Native(Vars.data());
+            if (!eval(W->getCond())) return 0;
+            eval(W->getBody());
+            // Looked up again: the body may have added loops to the map.
+            LoopState &L = Loops[W];
+            if (++L.Iterations == TierThreshold) L.Native = CompileHotLoop(W);
+        }
+    }
+
+    int32_t eval(GenericASTNode *N) {
+        switch (N->getKind()) {
+            case ASTKind::Block: {
+                int32_t Last = 0;
+                for (GenericASTNode *S : *static_cast<BlockASTNode *>(N)) Last = eval(S);
+                return static_cast<BlockASTNode *>(N)->yieldsLast() ? Last : 0;
+            }
+            case ASTKind::Number:
+                return static_cast<NumberASTNode *>(N)->getVal();
+            case ASTKind::VariableRead:
+                return Vars[static_cast<VariableReadASTNode *>(N)->getSym()];
+            case ASTKind::VariableDeclaration:
+                return 0;
+            case ASTKind::VariableAssign: {
+                auto *V = static_cast<VariableAssignASTNode *>(N);
+                return Vars[V->getVarSym()] = eval(V->getValue());
+            }
+            case ASTKind::BinaryExpr: {
+                BinaryExprAST::walk(
+                    static_cast<BinaryExprAST *>(N), Work, [](BinaryExprAST *) {},
+                    [&](GenericASTNode *Leaf) {
+                        int32_t Val = eval(Leaf);
+                        Operands.push_back(Val);
+                    },
+                    [&](BinaryExprAST *E) {
+                        int32_t R = Operands.back();
+                        Operands.pop_back();
+                        int32_t &L = Operands.back();
+                        if (!EvalBinaryOp(E->getOp(), L, R, L)) raise(SIGFPE);
+                    });
+                int32_t Result = Operands.back();
+                Operands.pop_back();
+                return Result;
+            }
+            case ASTKind::IfStatement: {
+                auto *I = static_cast<IfStatementAST *>(N);
+                return eval(I->getCond()) ? eval(I->getTrueExpr()) : eval(I->getFalseExpr());
+            }
+            case ASTKind::WhileStatement: {
+                auto *W = static_cast<WhileStatementAST *>(N);
+                if (TierThreshold) return evalTiered(W);
+                while (eval(W->getCond())) eval(W->getBody());
+                return 0;
+            }
+        }
+        return 0;
+    }
 
 public:
-    WhileStatementAST(unique_ptr<GenericASTNode> Cond, unique_ptr<GenericASTNode> Body)
-        : Cond(std::move(Cond)), Body(std::move(Body)) {}
+    // A TierThreshold of 0 never compiles anything.
+    Interpreter(uint32_t TierThreshold = 0) : TierThreshold(TierThreshold) {}
+
+    // Returns false if codegen would reject the program; the reason has been
+    // reported by then.
+    bool run(GenericASTNode *AST, int32_t &Result) {
+        if (!ResolveVariables(AST)) return false;
+        Vars.assign(Comp->Symbols.size(), 0);
+        Result = eval(AST);
+        return true;
+    }
+};
 
-    void toString() override {
-        printf("While Statement:\n");
-        printf("Condition: ");
-        Cond->toString();
-        printf("\nBody: ");
-        Body->toString();
+//===----------------------------------------------------------------------===//
+// Bytecode VM
+//===----------------------------------------------------------------------===//
+
+// Three-address code over a flat register file, run with --vm. Registers
+// 0 .. Symbols.size() - 1 are the variables; temporaries are handed out above
+// them in stack order, so the file is exactly as large as the deepest
+// expression needs. Each instruction is 16 bytes and names its registers
+// directly, so an add is one dispatch instead of a tree walk with calls.
+// Semantics are the interpreter's, and thereby the Emit* helpers'.
+class BytecodeVM {
+    enum class Opcode : uint8_t { LoadImm, Move, Add, Sub, Mul, Div, Rem, Jump, JumpIfZero, Ret };
+
+    struct Instr {
+        Opcode Op;
+        uint32_t A;      // destination, or the tested/returned register
+        union {
+            uint32_t B;  // first operand, or the jump target
+            int32_t Imm; // LoadImm
+        };
+        uint32_t C;      // second operand
+    };
+
+    vector<Instr> Code;
+    vector<int32_t> Regs;
+    uint32_t NextReg = 0;
+    uint32_t NumRegs = 0;
+
+    // Operator trees are lowered with explicit stacks: Marks holds NextReg as
+    // it was when each open operator was entered, Operands the registers of
+    // the operands lowered so far.
+    BinaryExprAST::WalkStack Work;
+    vector<uint32_t> Marks;
+    vector<uint32_t> Operands;
+
+    uint32_t emit(Opcode Op, uint32_t A, uint32_t B = 0, uint32_t C = 0) {
+        Instr I;
+        I.Op = Op;
+        I.A = A;
+        I.B = B;
+        I.C = C;
+        Code.push_back(I);
+        return Code.size() - 1;
     }
 
-    Value *codegen() override {
-        Value *CondV = Cond->codegen();
-        if (!CondV) return nullptr;
+    uint32_t temp() {
+        uint32_t R = NextReg++;
+        if (NextReg > NumRegs) NumRegs = NextReg;
+        return R;
+    }
+
+    uint32_t loadImm(int32_t Val) {
+        uint32_t R = temp();
+        uint32_t I = emit(Opcode::LoadImm, R);
+        Code[I].Imm = Val;
+        return R;
+    }
+
+    // Returns the register holding N's value. A variable read is just the
+    // variable's register: operands in this language are expressions, which
+    // cannot assign, so nothing changes it before the value is used.
+    uint32_t lower(GenericASTNode *N) {
+        uint32_t Mark = NextReg;
+        switch (N->getKind()) {
+            case ASTKind::Block: {
+                auto *Block = static_cast<BlockASTNode *>(N);
+                // The parser never builds an empty block, but Last must not wrap.
+                if (Block->size() == 0) return loadImm(0);
+                uint32_t Last = Block->size() - 1;
+                for (uint32_t i = 0; i < Last; ++i) {
+                    lower((*Block)[i]);
+                    NextReg = Mark;
+                }
+                if (Block->yieldsLast()) return lower((*Block)[Last]);
+                lower((*Block)[Last]);
+                NextReg = Mark;
+                return loadImm(0);
+            }
+            case ASTKind::Number:
+                return loadImm(static_cast<NumberASTNode *>(N)->getVal());
+            case ASTKind::VariableRead:
+                return static_cast<VariableReadASTNode *>(N)->getSym();
+            case ASTKind::VariableDeclaration:
+                return loadImm(0);
+            case ASTKind::VariableAssign: {
+                auto *V = static_cast<VariableAssignASTNode *>(N);
+                uint32_t Val = lower(V->getValue());
+                emit(Opcode::Move, V->getVarSym(), Val);
+                NextReg = Mark;
+                return V->getVarSym();
+            }
+            case ASTKind::BinaryExpr: {
+                BinaryExprAST::walk(
+                    static_cast<BinaryExprAST *>(N), Work,
+                    [&](BinaryExprAST *) { Marks.push_back(NextReg); },
+                    [&](GenericASTNode *Leaf) {
+                        uint32_t Reg = lower(Leaf);
+                        Operands.push_back(Reg);
+                    },
+                    [&](BinaryExprAST *E) {
+                        uint32_t R = Operands.back();
+                        Operands.pop_back();
+                        uint32_t L = Operands.back();
+                        NextReg = Marks.back();
+                        Marks.pop_back();
+                        uint32_t Dst = Operands.back() = temp();
+                        switch (E->getOp()) {
+                            case '+': emit(Opcode::Add, Dst, L, R); break;
+                            case '-': emit(Opcode::Sub, Dst, L, R); break;
+                            case '*': emit(Opcode::Mul, Dst, L, R); break;
+                            case '/': emit(Opcode::Div, Dst, L, R); break;
+                            case '%': emit(Opcode::Rem, Dst, L, R); break;
+                        }
+                    });
+                uint32_t Dst = Operands.back();
+                Operands.pop_back();
+                return Dst;
+            }
+            case ASTKind::IfStatement: {
+                auto *I = static_cast<IfStatementAST *>(N);
+                uint32_t Dst = temp();
+                uint32_t ToElse = emit(Opcode::JumpIfZero, lower(I->getCond()));
+                NextReg = Mark + 1;
+                emit(Opcode::Move, Dst, lower(I->getTrueExpr()));
+                NextReg = Mark + 1;
+                uint32_t ToEnd = emit(Opcode::Jump, 0);
+                Code[ToElse].B = Code.size();
+                emit(Opcode::Move, Dst, lower(I->getFalseExpr()));
+                NextReg = Mark + 1;
+                Code[ToEnd].B = Code.size();
+                return Dst;
+            }
+            case ASTKind::WhileStatement: {
+                auto *W = static_cast<WhileStatementAST *>(N);
+                uint32_t Top = Code.size();
+                uint32_t ToEnd = emit(Opcode::JumpIfZero, lower(W->getCond()));
+                NextReg = Mark;
+                lower(W->getBody());
+                NextReg = Mark;
+                emit(Opcode::Jump, 0, Top);
+                Code[ToEnd].B = Code.size();
+                return loadImm(0);
+            }
+        }
+        return loadImm(0);
+    }
+
+public:
+    // Returns false if codegen would reject the program; the reason has been
+    // reported by then.
+    bool build(GenericASTNode *AST) {
+        if (!ResolveVariables(AST)) return false;
+        NextReg = NumRegs = Comp->Symbols.size();
+        emit(Opcode::Ret, lower(AST));
+        return true;
+    }
+
+    size_t size() const { return Code.size(); }
+    uint32_t registers() const { return NumRegs; }
+
+    int32_t run();
+};
+
+// With GCC and Clang each handler jumps straight to the next one through a
+// table of label addresses, so every handler has its own indirect branch
+// for the predictor; elsewhere this is an ordinary switch in a loop.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+int32_t BytecodeVM::run()
+{
+    Regs.assign(NumRegs, 0);
+    int32_t *R = Regs.data();
+    const Instr *IP = Code.data();
+
+#ifdef VM_COMPUTED_GOTO
+    static void *const Handlers[] = {&&Do_LoadImm, &&Do_Move, &&Do_Add, &&Do_Sub, &&Do_Mul,
+                                     &&Do_Div, &&Do_Rem, &&Do_Jump, &&Do_JumpIfZero, &&Do_Ret};
+#define VM_CASE(Name) Do_##Name: case Opcode::Name
+#define VM_NEXT goto *Handlers[(size_t)IP->Op]
+    VM_NEXT;
+#else
+#define VM_CASE(Name) case Opcode::Name
+#define VM_NEXT goto Dispatch
+Dispatch:
+#endif
+    switch (IP->Op) {
+        VM_CASE(LoadImm):
+            R[IP->A] = IP->Imm;
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Move):
+            R[IP->A] = R[IP->B];
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Add):
+            R[IP->A] = (int32_t)((uint32_t)R[IP->B] + (uint32_t)R[IP->C]);
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Sub):
+            R[IP->A] = (int32_t)((uint32_t)R[IP->B] - (uint32_t)R[IP->C]);
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Mul):
+            R[IP->A] = (int32_t)((uint32_t)R[IP->B] * (uint32_t)R[IP->C]);
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Div):
+            if (!EvalBinaryOp('/', R[IP->B], R[IP->C], R[IP->A])) raise(SIGFPE);
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Rem):
+            if (!EvalBinaryOp('%', R[IP->B], R[IP->C], R[IP->A])) raise(SIGFPE);
+            ++IP;
+            VM_NEXT;
+        VM_CASE(Jump):
+            IP = Code.data() + IP->B;
+            VM_NEXT;
+        VM_CASE(JumpIfZero):
+            IP = R[IP->A] ? IP + 1 : Code.data() + IP->B;
+            VM_NEXT;
+        VM_CASE(Ret):
+            return R[IP->A];
+    }
+#undef VM_CASE
+#undef VM_NEXT
+    return 0;
+}
 
-        CondV = Builder->CreateICmpNE(
-            CondV,
-            ConstantInt::get(*TheContext, APInt(32, 0, true)),
-            "ifcond"
-        );
+//===----------------------------------------------------------------------===//
+// Token buffer
+//===----------------------------------------------------------------------===//
 
-        Function *TheFunction = Builder->GetInsertBlock()->getParent();
-        BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "while.body", TheFunction);
-        BasicBlock *EndBB = BasicBlock::Create(*TheContext, "while.end", TheFunction);
+// The whole input is lexed before parsing into parallel arrays, so the parser
+// walks dense memory instead of calling yylex() once per token. Kinds and
+// values are all the parser reads; offsets are only needed for diagnostics
+// and stay out of its way. The last token is always end of input (kind 0).
+class TokenBuffer {
+    vector<uint16_t> Kinds;
+    vector<int32_t> Values;
+    vector<size_t> Offsets;
 
-        Builder->CreateCondBr(CondV, BodyBB, EndBB);
+public:
+    // Replaces whatever was lexed before.
+    void lexAll(size_t InputSize = 0) {
+        Kinds.clear();
+        Values.clear();
+        Offsets.clear();
+
+        // Generated arithmetic averages about one token per two bytes.
+        Kinds.reserve(InputSize / 2 + 1);
+        Values.reserve(InputSize / 2 + 1);
+        Offsets.reserve(InputSize / 2 + 1);
+
+        int Kind;
+        do {
+            Kind = yylex();
+            Kinds.push_back(Kind);
+            Values.push_back(Kind == NUMBER || Kind == IDENT ? yylval : 0);
+            Offsets.push_back(yyoffset);
+        } while (Kind != 0);
+    }
 
-        Builder->SetInsertPoint(BodyBB);
-        if (!Body->codegen()) return nullptr;
-        Builder->CreateBr(EndBB);
+    size_t size() const { return Kinds.size(); }
+    const uint16_t *kinds() const { return Kinds.data(); }
+    const int32_t *values() const { return Values.data(); }
+    const size_t *offsets() const { return Offsets.data(); }
+};
 
-        Builder->SetInsertPoint(EndBB);
+class TokenCursor {
+    const uint16_t *Kinds = nullptr;
+    const int32_t *Values = nullptr;
+    const size_t *Offsets = nullptr;
+    size_t Pos = 0, Last = 0;
 
-        return ConstantInt::get(Type::getInt32Ty(*TheContext), 0);
+public:
+    void reset(const TokenBuffer &Tokens) {
+        Kinds = Tokens.kinds();
+        Values = Tokens.values();
+        Offsets = Tokens.offsets();
+        Pos = 0;
+        Last = Tokens.size() - 1;
     }
 
+    int kind() const { return Kinds[Pos]; }
+    int value() const { return Values[Pos]; }
+    size_t offset() const { return Offsets[Pos]; }
+
+    // Kind of the token k positions ahead; past the end it is end of input.
+    int peek(size_t k) const { return Kinds[Pos + k < Last ? Pos + k : Last]; }
+
+    void advance() {
+        if (Pos < Last) ++Pos;
+    }
+
+    // For error recovery, which rescans a failed statement from its start.
+    size_t position() const { return Pos; }
+    void seek(size_t P) { Pos = P; }
 };
 
+//===----------------------------------------------------------------------===//
+// AST arena
+//===----------------------------------------------------------------------===//
+
+// Bump-pointer storage for the AST of one compilation. Nodes are carved out of
+// geometrically growing blocks and the whole tree goes away in one release();
+// only nodes with non-trivial members would get their destructors recorded
+// and run, and since variables hold symbol IDs rather than names, none do.
+class ASTArena {
+    static constexpr size_t MinBlockSize = 64 * 1024;
+    static constexpr size_t MaxBlockSize = 16 * 1024 * 1024;
+
+    struct Cleanup {
+        void *Object;
+        void (*Destroy)(void *);
+    };
+
+    vector<char *> Blocks;
+    vector<Cleanup> Cleanups;
+    char *Cur = nullptr, *End = nullptr;
+    size_t NextBlockSize = MinBlockSize;
+    size_t BytesUsed = 0, BytesReserved = 0;
+    size_t Counts[NumASTKinds] = {};
+
+    void *allocateSlow(size_t Size, size_t Align) {
+        size_t BlockSize = max(NextBlockSize, Size + Align);
+        Cur = (char *)safe_malloc(BlockSize);
+        End = Cur + BlockSize;
+        Blocks.push_back(Cur);
+        BytesReserved += BlockSize;
+        NextBlockSize = min(NextBlockSize * 2, MaxBlockSize);
+        return allocate(Size, Align);
+    }
+
+public:
+    ASTArena() = default;
+    ASTArena(const ASTArena &) = delete;
+    ASTArena &operator=(const ASTArena &) = delete;
+    ~ASTArena() { release(); }
+
+    void *allocate(size_t Size, size_t Align) {
+        uintptr_t P = ((uintptr_t)Cur + Align - 1) & ~(uintptr_t)(Align - 1);
+        if (!Cur || P + Size > (uintptr_t)End) return allocateSlow(Size, Align);
+        Cur = (char *)(P + Size);
+        BytesUsed += Size;
+        return (void *)P;
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args) {
+        T *Node = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!is_trivially_destructible<T>::value)
+            Cleanups.push_back({Node, [](void *P) { static_cast<T *>(P)->~T(); }});
+        ++Counts[(size_t)Node->getKind()];
+        return Node;
+    }
+
+    void release() {
+        for (Cleanup &C : Cleanups) C.Destroy(C.Object);
+        for (char *Block : Blocks) free(Block);
+        Cleanups.clear();
+        Blocks.clear();
+        Cur = End = nullptr;
+        NextBlockSize = MinBlockSize;
+        BytesUsed = BytesReserved = 0;
+        memset(Counts, 0, sizeof(Counts));
+    }
+
+    void printStats(FILE *Out) const {
+        size_t Nodes = 0;
+        for (size_t N : Counts) Nodes += N;
+        fprintf(Out, "AST arena: %zu nodes, %zu bytes used, %zu bytes reserved in %zu blocks\n",
+                Nodes, BytesUsed, BytesReserved, Blocks.size());
+        for (size_t K = 0; K < NumASTKinds; ++K)
+            fprintf(Out, "  %-20s %zu\n", ASTKindNames[K], Counts[K]);
+    }
+};
 
 //===----------------------------------------------------------------------===//
 // Parser
 //===----------------------------------------------------------------------===//
-int yylex();
-int symbol;
-extern int yylval;
+// What parsing one program produced. Errors do not stop the parser: a
+// statement that fails is skipped and parsing goes on with the next, so
+// Diagnostics lists every error found. AST is null only if the program as a
+// whole could not be parsed, and should only be used if ok().
+struct ParseResult {
+    GenericASTNode *AST = nullptr;
+    vector<Diagnostic> Diagnostics;
+
+    bool ok() const { return AST && Diagnostics.empty(); }
+};
 
-unique_ptr<GenericASTNode> Z();
-unique_ptr<GenericASTNode> E_AS();  
-unique_ptr<GenericASTNode> E_MDR();
-unique_ptr<GenericASTNode> E_IF();
-unique_ptr<GenericASTNode> E_WHILE();
-unique_ptr<GenericASTNode> T();
-unique_ptr<GenericASTNode> VAR_DECL();
-unique_ptr<GenericASTNode> VAR_ASSIGN();
+// Parses one program from a lexed TokenBuffer into Arena. All its working
+// state is in the object, so every compilation parses with a Parser of its
+// own.
+class Parser {
+    TokenCursor Tok;
+    ASTArena &Arena;
+    vector<Diagnostic> Diagnostics;
+
+    // Set for each symbol ID once an assignment to it has been parsed.
+    vector<bool> Declared;
+
+    // Expressions are parsed without recursion, so nesting depth is bounded
+    // by memory rather than by the native stack: operands and pending
+    // operators (including open parentheses) are kept on two explicit stacks.
+    // An operator is applied once an operator of lower or equal precedence
+    // follows it, which makes everything left associative, with * / % binding
+    // tighter than + -, exactly the trees the recursive E_AS/E_MDR/T grammar
+    // built.
+    vector<GenericASTNode *> ExprOperands;
+    vector<char> ExprOperators;
+
+    // Statements are collected here, above those of the blocks being parsed
+    // around this one, and copied into the arena once the block ends.
+    vector<GenericASTNode *> PendingStatements;
+
+    BlockASTNode *MakeBlock(GenericASTNode *const *Stmts, uint32_t Count, bool YieldsLast = false);
+    GenericASTNode *ParseError(const char *Message);
+    void Synchronize(size_t Start);
+    void ReduceExpr();
+
+    GenericASTNode *Z();
+    GenericASTNode *E_AS();
+    GenericASTNode *E_IF();
+    GenericASTNode *E_WHILE();
+    GenericASTNode *VAR_DECL(uint32_t Sym);
+    GenericASTNode *VAR_ASSIGN();
+    GenericASTNode *Statements();
+    GenericASTNode *Statement();
 
-unique_ptr<GenericASTNode> Statements();
-unique_ptr<GenericASTNode> Statement();
+public:
+    Parser(const TokenBuffer &Tokens, ASTArena &Arena) : Arena(Arena) { Tok.reset(Tokens); }
+
+    ParseResult parseProgram();
+};
 
-void next_symbol()
+// Copies Stmts into the arena as one block.
+BlockASTNode *Parser::MakeBlock(GenericASTNode *const *Stmts, uint32_t Count, bool YieldsLast)
 {
-    symbol = yylex();
+    auto **Span = (GenericASTNode **)Arena.allocate(Count * sizeof(GenericASTNode *), alignof(GenericASTNode *));
+    copy(Stmts, Stmts + Count, Span);
+    return Arena.make<BlockASTNode>(Span, Count, YieldsLast);
 }
 
-void err_n_die(const char* const fmt, ...) {
+static void err_n_die(const char* const fmt, ...) {
     va_list args;
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
@@ -384,155 +1725,965 @@ void err_n_die(const char* const fmt, ...) {
     exit(1);
 }
 
-unique_ptr<GenericASTNode> Z(){
+// Records a syntax error at the current token. The parse functions return
+// the null this returns, up to Statements(), which recovers.
+GenericASTNode *Parser::ParseError(const char *Message)
+{
+    Diagnostics.push_back({Tok.offset(), Message});
+    return nullptr;
+}
+
+// Panic mode: skips the statement that failed after starting at token Start,
+// up to the ';' that ends it or the '}' that closes the enclosing block, and
+// leaves the cursor there. Braces opened within the statement are skipped
+// along with it, so recovery does not stop inside a nested block.
+void Parser::Synchronize(size_t Start)
+{
+    Tok.seek(Start);
+    int Depth = 0;
+    for (;; Tok.advance()) {
+        int Kind = Tok.kind();
+        if (Kind == 0) return;
+        if (Kind == '{') {
+            ++Depth;
+        } else if (Kind == '}') {
+            if (Depth-- == 0) return;
+        } else if (Kind == ';' && Depth == 0) {
+            return;
+        }
+    }
+}
 
-    if(symbol == IF){
+GenericASTNode *Parser::Z(){
+
+    if(Tok.kind() == IF){
         return E_IF();
     }
-    if(symbol == WHILE){
+    if(Tok.kind() == WHILE){
         return E_WHILE();
     }
+    if (Tok.kind() == IDENT && Tok.peek(1) == '=') {
+        return VAR_ASSIGN();
+    }
 
     return E_AS();
 }
 
-unique_ptr<GenericASTNode> E_IF() {
-    if (symbol != IF) err_n_die("Error: Expected 'if'.\n");
-    next_symbol();
+GenericASTNode *Parser::E_IF() {
+    if (Tok.kind() != IF) return ParseError("Expected 'if'.");
+    Tok.advance();
 
-    if (symbol != '(') err_n_die("Error: Expected '('.\n");
-    next_symbol();
+    if (Tok.kind() != '(') return ParseError("Expected '('.");
+    Tok.advance();
     auto Cond = E_AS();
-    if (symbol != ')') err_n_die("Error: Expected ')'.\n");
-    next_symbol();
+    if (!Cond) return nullptr;
+    if (Tok.kind() != ')') return ParseError("Expected ')'.");
+    Tok.advance();
 
-    if (symbol != '{') err_n_die("Error: Expected '{' for true branch.\n");
-    next_symbol();
+    if (Tok.kind() != '{') return ParseError("Expected '{' for true branch.");
+    Tok.advance();
     auto TrueExpr = E_AS();
-    if (symbol != '}') err_n_die("Error: Expected '}' for true branch.\n");
-    next_symbol();
-
-    unique_ptr<GenericASTNode> FalseExpr = nullptr;
-    if (symbol == ELSE) {
-        next_symbol();
-        if (symbol != '{') err_n_die("Error: Expected '{' for false branch.\n");
-        next_symbol();
+    if (!TrueExpr) return nullptr;
+    if (Tok.kind() != '}') return ParseError("Expected '}' for true branch.");
+    Tok.advance();
+
+    GenericASTNode *FalseExpr = nullptr;
+    if (Tok.kind() == ELSE) {
+        Tok.advance();
+        if (Tok.kind() != '{') return ParseError("Expected '{' for false branch.");
+        Tok.advance();
         FalseExpr = E_AS();
-        if (symbol != '}') err_n_die("Error: Expected '}' for false branch.\n");
-        next_symbol();
+        if (!FalseExpr) return nullptr;
+        if (Tok.kind() != '}') return ParseError("Expected '}' for false branch.");
+        Tok.advance();
+    } else {
+        FalseExpr = Arena.make<NumberASTNode>(0);
     }
 
-    return make_unique<IfStatementAST>(std::move(Cond), std::move(TrueExpr), std::move(FalseExpr));
+    return Arena.make<IfStatementAST>(Cond, TrueExpr, FalseExpr);
 }
 
 
-unique_ptr<GenericASTNode> E_AS() {
-    auto acc = E_MDR();
-    while (symbol == '+' || symbol == '-') {
-        char op = symbol;
-        next_symbol();
-        auto acc1 = E_MDR();
-        acc = make_unique<BinaryExprAST>(op, std::move(acc), std::move(acc1));
+static int Precedence(int Op)
+{
+    switch (Op) {
+        case '+':
+        case '-':
+            return 1;
+        case '*':
+        case '/':
+        case '%':
+            return 2;
+        default:
+            return 0;
     }
+}
 
-    return acc;
+void Parser::ReduceExpr()
+{
+    char Op = ExprOperators.back();
+    ExprOperators.pop_back();
+    GenericASTNode *RHS = ExprOperands.back();
+    ExprOperands.pop_back();
+    ExprOperands.back() = Arena.make<BinaryExprAST>(Op, ExprOperands.back(), RHS);
 }
 
-unique_ptr<GenericASTNode> E_MDR() {
-    auto acc = T();
-    while (symbol == '*' || symbol == '/' || symbol == '%') {
-        char op = symbol;
-        next_symbol();
-        auto rhs = T();
-        acc = make_unique<BinaryExprAST>(op, std::move(acc), std::move(rhs));
+GenericASTNode *Parser::E_AS() {
+    size_t OperandBase = ExprOperands.size();
+    size_t OperatorBase = ExprOperators.size();
+    size_t OpenParens = 0;
+    for (;;) {
+        // An operand, after any number of opening parentheses.
+        for (; Tok.kind() == '('; Tok.advance()) {
+            ExprOperators.push_back('(');
+            ++OpenParens;
+        }
+        if (Tok.kind() == NUMBER) {
+            ExprOperands.push_back(Arena.make<NumberASTNode>(Tok.value()));
+        } else if (Tok.kind() == IDENT) {
+            ExprOperands.push_back(Arena.make<VariableReadASTNode>(Tok.value()));
+        } else {
+            ExprOperands.resize(OperandBase);
+            ExprOperators.resize(OperatorBase);
+            return ParseError("Unexpected token in expression.");
+        }
+        Tok.advance();
+
+        // Closing parentheses, then either a binary operator or the end.
+        while (Tok.kind() == ')' && OpenParens) {
+            while (ExprOperators.back() != '(') ReduceExpr();
+            ExprOperators.pop_back();
+            --OpenParens;
+            Tok.advance();
+        }
+        int Prec = Precedence(Tok.kind());
+        if (!Prec) break;
+        while (ExprOperators.size() > OperatorBase && Precedence(ExprOperators.back()) >= Prec) ReduceExpr();
+        ExprOperators.push_back(Tok.kind());
+        Tok.advance();
+    }
+
+    if (OpenParens) {
+        ExprOperands.resize(OperandBase);
+        ExprOperators.resize(OperatorBase);
+        return ParseError("Expected closing parenthesis.");
     }
-    return acc;
+    while (ExprOperators.size() > OperatorBase) ReduceExpr();
+    GenericASTNode *Result = ExprOperands.back();
+    ExprOperands.pop_back();
+    return Result;
 }
 
-unique_ptr<GenericASTNode> T() {
-    if (symbol == '(') {
-        next_symbol();
-        auto acc = E_AS();
-        if (symbol == ')') {
-            next_symbol();
-            return acc;
-        } else {
-            err_n_die("Error: Expected closing parenthesis\n");
+GenericASTNode *Parser::Statement() {
+    if (Tok.kind() == IDENT && Tok.peek(1) == '=') return VAR_ASSIGN();
+    if (Tok.kind() == NUMBER || Tok.kind() == IDENT) return E_AS();
+    if (Tok.kind() == IF) return E_IF();
+    if (Tok.kind() == WHILE) return E_WHILE();
+    return ParseError("Unexpected token in statement.");
+}
+
+
+// A statement that fails is reported, skipped and left out of the block.
+GenericASTNode *Parser::Statements() {
+    size_t Base = PendingStatements.size();
+    for (;;) {
+        size_t Start = Tok.position();
+        if (GenericASTNode *S = Statement())
+            PendingStatements.push_back(S);
+        else
+            Synchronize(Start);
+        if (Tok.kind() != ';') break;
+        Tok.advance();
+    }
+
+    auto Block = MakeBlock(PendingStatements.data() + Base, PendingStatements.size() - Base);
+    PendingStatements.resize(Base);
+    return Block;
+}
+
+
+GenericASTNode *Parser::VAR_DECL(uint32_t Sym) {
+    if (Sym >= Declared.size()) Declared.resize(Comp->Symbols.size());
+    Declared[Sym] = true;
+    return Arena.make<VariableDeclarationASTNode>(Sym);
+}
+
+// There is no declaration syntax: the first assignment to a name declares it.
+GenericASTNode *Parser::VAR_ASSIGN() {
+    if (Tok.kind() != IDENT) return ParseError("Expected a variable name.");
+    uint32_t Sym = Tok.value();
+    Tok.advance();
+    if (Tok.kind() != '=') return ParseError("Expected '='.");
+    Tok.advance();
+
+    auto Value = E_AS();
+    if (!Value) return nullptr;
+    auto Assign = Arena.make<VariableAssignASTNode>(Sym, Value);
+    if (Sym < Declared.size() && Declared[Sym]) return Assign;
+    GenericASTNode *Stmts[] = {VAR_DECL(Sym), Assign};
+    return MakeBlock(Stmts, 2, true);
+}
+
+
+GenericASTNode *Parser::E_WHILE() {
+    if (Tok.kind() != WHILE) return ParseError("Expected 'while'.");
+    Tok.advance();
+
+    if (Tok.kind() != '(') return ParseError("Expected '('.");
+    Tok.advance();
+    auto Cond = E_AS();
+    if (!Cond) return nullptr;
+    if (Tok.kind() != ')') return ParseError("Expected ')'.");
+    Tok.advance();
+
+    if (Tok.kind() != '{') return ParseError("Expected '{' for while body.");
+    Tok.advance();
+    auto Body = Statements(); 
+    if (Tok.kind() != '}') return ParseError("Expected '}' for while body.");
+    Tok.advance();
+
+    return Arena.make<WhileStatementAST>(Cond, Body);
+}
+
+// Parses the whole token buffer as one program. The result's AST lives in
+// Arena until it is released.
+ParseResult Parser::parseProgram()
+{
+    ParseResult Result;
+    Result.AST = Z();
+    if (Result.AST) {
+        // The line break that ends a program typed on stdin is allowed; any
+        // other token after the program is an error.
+        while (Tok.kind() == '\n') Tok.advance();
+        if (Tok.kind() != 0) ParseError("Expected end of input.");
+    }
+    Result.Diagnostics = std::move(Diagnostics);
+    return Result;
+}
+
+// Prints each diagnostic as "Error at <line>:<column>: <message>". Positions
+// need the source text, which only --input keeps; for stdin the byte offset
+// is given instead.
+static void PrintDiagnostics(const vector<Diagnostic> &Diagnostics, StringRef Source)
+{
+    // Diagnostics come in source order, so lines are counted in one pass.
+    size_t Pos = 0, LineStart = 0;
+    unsigned Line = 1;
+    for (const Diagnostic &D : Diagnostics) {
+        if (Source.empty()) {
+            fprintf(stderr, "Error at byte %zu: %s\n", D.Offset, D.Message.c_str());
+            continue;
         }
-    } else if (symbol == NUMBER) {
-        auto numNode = make_unique<NumberASTNode>(yylval);
-        next_symbol();
-        return numNode;
-    } else {
-        err_n_die("Error: Unexpected token\n");
+        if (D.Offset < Pos) {
+            Pos = LineStart = 0;
+            Line = 1;
+        }
+        for (; Pos < D.Offset && Pos < Source.size(); ++Pos) {
+            if (Source[Pos] == '\n') {
+                ++Line;
+                LineStart = Pos + 1;
+            }
+        }
+        fprintf(stderr, "Error at %u:%zu: %s\n", Line, D.Offset - LineStart + 1, D.Message.c_str());
     }
-    return nullptr;
 }
 
-unique_ptr<GenericASTNode> Statement() {
-    unique_ptr<GenericASTNode> node;
-    if (symbol == NUMBER) {
-        node = E_AS();
-    } else if (symbol == IF) {
-        node = E_IF();
-    } else if (symbol == WHILE) {
-        node = E_WHILE();
-    } else {
-        err_n_die("%d %c Error: Unexpected token in statement\n", symbol, symbol);
+
+//===----------------------------------------------------------------------===//
+// Input
+//===----------------------------------------------------------------------===//
+
+// Maps the source file and hands the mapping to the lexer, so the input is
+// never copied through stdio. yy_scan_buffer() wants two NUL bytes after the
+// text: a zero-filled anonymous region with room for them is reserved first
+// and the file is mapped over its start, so the bytes behind the text are
+// either the zero tail of the file's last page or the spare anonymous page.
+// The mapping is private and writable because flex temporarily stores a NUL
+// after each token; the hand-written lexer only reads it. The text stays
+// mapped for the rest of the run, so diagnostics can give line and column.
+static StringRef ReadInputStream(int fd, const char *Path);
+
+static StringRef MapInputFile(const char *Path)
+{
+    int fd = open(Path, O_RDONLY);
+    if (fd < 0) err_n_die("Error: Cannot open %s: %s\n", Path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) err_n_die("Error: Cannot stat %s: %s\n", Path, strerror(errno));
+    if (!S_ISREG(st.st_mode)) return ReadInputStream(fd, Path);
+    size_t Size = st.st_size;
+
+    size_t Page = sysconf(_SC_PAGESIZE);
+    size_t Reserved = (Size + 2 + Page - 1) / Page * Page;
+    char *Base = (char *)mmap(nullptr, Reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Base == MAP_FAILED) err_n_die("Error: Cannot map %s: %s\n", Path, strerror(errno));
+
+    if (Size && mmap(Base, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        err_n_die("Error: Cannot map %s: %s\n", Path, strerror(errno));
+    close(fd);
+
+    madvise(Base, Size, MADV_SEQUENTIAL);
+    if (!yy_scan_buffer(Base, Size + 2)) err_n_die("Error: Cannot scan %s\n", Path);
+    return StringRef(Base, Size);
+}
+
+// A pipe, such as /dev/stdin or a process substitution, has no size to map,
+// so it is read into memory to its end instead, followed by the two NUL
+// bytes the lexer wants.
+static StringRef ReadInputStream(int fd, const char *Path)
+{
+    size_t Size = 0, Capacity = 64 * 1024;
+    char *Base = (char *)safe_malloc(Capacity);
+    for (;;) {
+        if (Capacity - Size < 4096) Base = (char *)safe_realloc(Base, Capacity *= 2);
+        ssize_t Read = read(fd, Base + Size, Capacity - Size - 2);
+        if (Read < 0 && errno == EINTR) continue;
+        if (Read < 0) err_n_die("Error: Cannot read %s: %s\n", Path, strerror(errno));
+        if (Read == 0) break;
+        Size += Read;
+    }
+    close(fd);
+
+    Base[Size] = Base[Size + 1] = '\0';
+    if (!yy_scan_buffer(Base, Size + 2)) err_n_die("Error: Cannot scan %s\n", Path);
+    return StringRef(Base, Size);
+}
+
+//===----------------------------------------------------------------------===//
+// Target machine
+//===----------------------------------------------------------------------===//
+
+// "+feature,-feature,..." for everything the host CPU does and does not have.
+static string HostCPUFeatures()
+{
+    StringMap<bool> HostFeatures;
+    string Features;
+    if (!sys::getHostCPUFeatures(HostFeatures)) return Features;
+    for (auto &F : HostFeatures) {
+        if (!Features.empty()) Features += ',';
+        Features += F.second ? '+' : '-';
+        Features += F.first().str();
     }
-    return make_unique<StatementASTNode>(std::move(node));
+    return Features;
 }
 
+static CodeGenOpt::Level CodeGenLevel(OptimizationLevel Level)
+{
+    if (Level == OptimizationLevel::O0) return CodeGenOpt::None;
+    if (Level == OptimizationLevel::O1) return CodeGenOpt::Less;
+    if (Level == OptimizationLevel::O3) return CodeGenOpt::Aggressive;
+    return CodeGenOpt::Default;
+}
+
+// Registers the host target with LLVM, once per process however many threads
+// compile.
+static void InitializeHostTarget()
+{
+    static std::once_flag Once;
+    std::call_once(Once, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+    });
+}
+
+// Creates the TargetMachine for the host triple. An empty CPU means the
+// triple's generic CPU; Features is a -mattr style list. Returns null and
+// sets Err if there is no such target or it has no such CPU; LLVM would
+// otherwise abort on an unknown CPU.
+static unique_ptr<TargetMachine> CreateTargetMachine(const string &CPU, const string &Features,
+                                                     OptimizationLevel Level, string &Err)
+{
+    InitializeHostTarget();
 
-unique_ptr<GenericASTNode> Statements() {
-    unique_ptr<GenericASTNode> head = Statement();
-    GenericASTNode* current = head.get();
+    string TargetTriple = sys::getDefaultTargetTriple();
+    const Target *T = TargetRegistry::lookupTarget(TargetTriple, Err);
+    if (!T) return nullptr;
 
-    while (symbol == ';') {
-        next_symbol();
-        auto newNode = Statement();
-        newNode->toString();
-        auto stmtNode = dynamic_cast<StatementASTNode*>(current);
-        if (!stmtNode) {
-            err_n_die("Invalid cast to StatementASTNode.\n");
+    unique_ptr<MCSubtargetInfo> STI(T->createMCSubtargetInfo(TargetTriple, "", ""));
+    if (!CPU.empty() && (!STI || !STI->isCPUStringValid(CPU))) {
+        Err = "'" + CPU + "' is not a CPU of " + TargetTriple;
+        return nullptr;
+    }
+
+    unique_ptr<TargetMachine> TM(T->createTargetMachine(TargetTriple, CPU, Features, TargetOptions(), Reloc::PIC_,
+                                                        std::nullopt, CodeGenLevel(Level)));
+    if (!TM) Err = "Cannot create target machine for " + TargetTriple;
+    return TM;
+}
+
+//===----------------------------------------------------------------------===//
+// Output
+//===----------------------------------------------------------------------===//
+// Writes the whole module to OS in one pass: textual IR, bitcode (a fraction
+// of the size and much faster for lli and opt to load) or an object file.
+// OS may be a file, stdout or a raw_svector_ostream; the module is left in
+// place for whatever runs next. Returns false if the target cannot write
+// objects.
+static bool EmitModule(Module &M, EmitKind Kind, raw_pwrite_stream &OS)
+{
+    switch (Kind) {
+        case EmitKind::LL:
+            M.print(OS, nullptr);
+            break;
+        case EmitKind::BC:
+            WriteBitcodeToFile(M, OS);
+            break;
+        case EmitKind::Obj:
+        case EmitKind::Exe: {
+            legacy::PassManager PM;
+            if (Comp->TheTargetMachine->addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile)) return false;
+            PM.run(M);
+            break;
         }
-        stmtNode->setNextNode(std::move(newNode));
-        current = stmtNode->getNextNode();
     }
+    return true;
+}
 
-    return head ? std::move(head) : std::make_unique<NumberASTNode>(0);
+// "-" is stdout.
+static void WriteOutputFile(EmitKind Kind, const char *Filename)
+{
+    std::error_code EC;
+    raw_fd_ostream dest(Filename, EC, Kind == EmitKind::LL ? sys::fs::OF_Text : sys::fs::OF_None);
+    if (EC) err_n_die("Error: Could not open file %s: %s\n", Filename, EC.message().c_str());
+
+    // The object writer patches headers it has already written, so a pipe
+    // gets the object in one piece once it is complete.
+    bool Written;
+    if (Kind != EmitKind::LL && Kind != EmitKind::BC && !dest.supportsSeeking()) {
+        buffer_ostream Buffered(dest);
+        Written = EmitModule(*Comp->TheModule, Kind, Buffered);
+    } else {
+        Written = EmitModule(*Comp->TheModule, Kind, dest);
+    }
+    if (!Written) err_n_die("Error: The target cannot emit object files\n");
 }
 
+// Writes the object to a temporary file and links it with the system C
+// compiler driver, which supplies the C runtime that calls main().
+static void WriteExecutable(const char *Filename)
+{
+    SmallString<128> ObjectFile;
+    if (std::error_code EC = sys::fs::createTemporaryFile("codingparser", "o", ObjectFile))
+        err_n_die("Error: Cannot create temporary file: %s\n", EC.message().c_str());
+    WriteOutputFile(EmitKind::Obj, ObjectFile.c_str());
+
+    auto CC = sys::findProgramByName("cc");
+    if (!CC) err_n_die("Error: Cannot find cc to link with: %s\n", CC.getError().message().c_str());
+
+    StringRef Args[] = {*CC, "-o", Filename, ObjectFile};
+    string Err;
+    int Status = sys::ExecuteAndWait(*CC, Args, std::nullopt, {}, 0, 0, &Err);
+    sys::fs::remove(ObjectFile);
+    if (Status != 0) err_n_die("Error: Linking %s failed %s\n", Filename, Err.c_str());
+}
 
-unique_ptr<GenericASTNode> E_WHILE() {
-    if (symbol != WHILE) err_n_die("Error: Expected 'while'.\n");
-    next_symbol();
+// Compiles the module with ORC's LLJIT and calls main() in this process,
+// replacing the output.ll + lli-17 round trip. The module and its context
+// are handed over to the JIT. Returns null and sets Err on failure.
+static unique_ptr<orc::LLJIT> CreateJIT(string &Err)
+{
+    InitializeHostTarget();
 
-    if (symbol != '(') err_n_die("Error: Expected '('.\n");
-    next_symbol();
-    auto Cond = E_AS();
-    if (symbol != ')') err_n_die("Error: Expected ')'.\n");
-    next_symbol();
+    auto Created = orc::LLJITBuilder().create();
+    if (!Created) {
+        Err = "Cannot create JIT: " + toString(Created.takeError());
+        return nullptr;
+    }
+    return std::move(*Created);
+}
 
-    if (symbol != '{') err_n_die("Error: Expected '{' for while body.\n");
-    next_symbol();
-    auto Body = Statements(); 
-    if (symbol != '}') err_n_die("Error: Expected '}' for while body.\n");
-    next_symbol();
+// The module built last and its context, taken from the compilation.
+static orc::ThreadSafeModule TakeModule()
+{
+    Comp->Builder.reset();
+    return orc::ThreadSafeModule(std::move(Comp->TheModule), std::move(Comp->TheContext));
+}
 
-    return make_unique<WhileStatementAST>(std::move(Cond), std::move(Body));
+// Hands a module and its context over to the JIT and returns the address of
+// the function Name in it. With a tracker RT the module can be removed again.
+// Returns null and sets Err on failure.
+static void *AddModuleToJIT(orc::LLJIT &JIT, orc::ThreadSafeModule TSM, const char *Name, string &Err,
+                            orc::ResourceTrackerSP RT = nullptr)
+{
+    if (Error E = RT ? JIT.addIRModule(RT, std::move(TSM)) : JIT.addIRModule(std::move(TSM))) {
+        Err = "Cannot add module to JIT: " + toString(std::move(E));
+        return nullptr;
+    }
+
+    auto Sym = JIT.lookup(Name);
+    if (!Sym) {
+        Err = "Cannot find " + string(Name) + ": " + toString(Sym.takeError());
+        return nullptr;
+    }
+    return Sym->toPtr<void *>();
 }
 
+static int RunMainInProcess()
+{
+    unique_ptr<orc::LLJIT> JIT;
+    int (*Main)();
+    {
+        PhaseTimer Timer("jit");
+        string Err;
+        JIT = CreateJIT(Err);
+        if (!JIT) err_n_die("Error: %s\n", Err.c_str());
+        Main = (int (*)())AddModuleToJIT(*JIT, TakeModule(), "main", Err);
+        if (!Main) err_n_die("Error: %s\n", Err.c_str());
+    }
+
+    PhaseTimer Timer("run");
+    return Main();
+}
 
 //===----------------------------------------------------------------------===//
-// main function
+// Tiered execution
 //===----------------------------------------------------------------------===//
-int main()
+
+// Created when the first loop gets hot, so programs without one never
+// initialize LLVM.
+static unique_ptr<orc::LLJIT> LoopJIT;
+static unsigned NumHotLoops;
+
+// Compiles Loop into a function of the interpreter's variable array, in a
+// module of its own, and returns it, or nullptr if it cannot be compiled (the
+// interpreter then keeps running the loop). The array is not aliased by
+// anything else, so the optimizer keeps the variables in registers for the
+// duration of the loop.
+static LoopFunction CompileHotLoop(WhileStatementAST *Loop)
 {
+    PhaseTimer Timer("tier-up");
+    string Err;
+    if (!LoopJIT) LoopJIT = CreateJIT(Err);
+    if (!LoopJIT) {
+        ReportError("%s", Err.c_str());
+        return nullptr;
+    }
+
+    string Name = "loop." + to_string(NumHotLoops++);
     InitializeModule();
+    Type *Int32Ty = Type::getInt32Ty(*Comp->TheContext);
+    Type *Params[] = {PointerType::getUnqual(Int32Ty)};
+    FunctionType *FT = FunctionType::get(Int32Ty, Params, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, Comp->TheModule.get());
+    F->addParamAttr(0, Attribute::NoAlias);
+    Comp->Builder->SetInsertPoint(BasicBlock::Create(*Comp->TheContext, "entry", F));
+
+    Comp->VariableSlots.assign(Comp->Symbols.size(), nullptr);
+    Comp->VariableFrame = F->getArg(0);
+    Value *Result = EmitWhile([&] { return Loop->getCond()->codegen(); },
+                              [&] { return Loop->getBody()->codegen(); });
+    Comp->VariableFrame = nullptr;
+    if (!Result) return nullptr;
+    Comp->Builder->CreateRet(Result);
+    if (!VerifyGenerated(*F)) return nullptr;
+
+    // Worth optimizing properly even when the program itself asked for -O0.
+    OptimizeModule(*Comp->TheModule, Comp->OptLevel == OptimizationLevel::O0 ? OptimizationLevel::O2 : Comp->OptLevel);
+    if (Trace.DumpIR) {
+        raw_fd_ostream Dump(STDERR_FILENO, false);
+        Comp->TheModule->print(Dump, nullptr);
+    }
+    auto Native = (LoopFunction)AddModuleToJIT(*LoopJIT, TakeModule(), Name.c_str(), Err);
+    if (!Native) ReportError("%s", Err.c_str());
+    return Native;
+}
 
-    next_symbol();
-    CodeGenTopLevel(Z());
+} // end anonymous namespace
 
-    return 0;
-}
\ No newline at end of file
+//===----------------------------------------------------------------------===//
+// Library API (codingparser.h)
+//===----------------------------------------------------------------------===//
+
+// The lexers keep their position in globals, so compiles on different threads
+// take turns lexing.
+static mutex LexerMutex;
+
+CompilationUnit::CompilationUnit() = default;
+CompilationUnit::CompilationUnit(CompilationUnit &&) = default;
+CompilationUnit &CompilationUnit::operator=(CompilationUnit &&) = default;
+CompilationUnit::~CompilationUnit() = default;
+
+Module *CompilationUnit::module() const
+{
+    return Context ? Context->TheModule.get() : nullptr;
+}
+
+LLVMContext *CompilationUnit::context() const
+{
+    return Context ? Context->TheContext.get() : nullptr;
+}
+
+Compiler::Compiler(const CompilerOptions &Options) : Options(Options)
+{
+    string CPU = Options.CPU, Features = Options.Features;
+    if (CPU == "native") {
+        CPU = sys::getHostCPUName().str();
+        Features = Features.empty() ? HostCPUFeatures() : HostCPUFeatures() + ',' + Features;
+    }
+    Target = CreateTargetMachine(CPU, Features, Options.OptLevel, TargetError);
+}
+
+Compiler::~Compiler() = default;
+
+CompilationUnit Compiler::compile(StringRef Source)
+{
+    CompilationUnit Unit;
+    if (!Target) {
+        Unit.Diagnostics.push_back({Diagnostic::NoOffset, TargetError});
+        return Unit;
+    }
+    Unit.Context = std::make_unique<CompilationContext>();
+    CompilationContext &C = *Unit.Context;
+    C.OptLevel = Options.OptLevel;
+    C.TheTargetMachine = Target.get();
+    ActiveCompilation Activate(C);
+
+    // The lexer scans in place and wants two NUL bytes after the text.
+    vector<char> Buffer(Source.size() + 2, '\0');
+    copy(Source.begin(), Source.end(), Buffer.begin());
+    TokenBuffer Tokens;
+    {
+        lock_guard<mutex> Lock(LexerMutex);
+        FILE *SavedEcho = yyecho;
+        SymbolTable *SavedSymbols = Symbols;
+        yyecho = nullptr;
+        Symbols = &C.Symbols;
+        YY_BUFFER_STATE Scanned = yy_scan_buffer(Buffer.data(), Buffer.size());
+        Tokens.lexAll(Source.size());
+        yy_delete_buffer(Scanned);
+        yyecho = SavedEcho;
+        Symbols = SavedSymbols;
+    }
+
+    ASTArena Arena;
+    ParseResult Parsed = Parser(Tokens, Arena).parseProgram();
+    bool Parses = Parsed.ok();
+    Unit.Diagnostics = std::move(Parsed.Diagnostics);
+    if (!Parses) return Unit;
+
+    GenericASTNode *AST = Parsed.AST;
+    if (Options.ConstEval) AST = FoldConstants(AST);
+    InitializeModule();
+    Unit.Valid = CodeGenTopLevel([&] { return AST->codegen(); });
+    C.Builder.reset();
+    for (Diagnostic &D : C.Diagnostics) Unit.Diagnostics.push_back(std::move(D));
+    C.Diagnostics.clear();
+    return Unit;
+}
+
+bool Compiler::emit(CompilationUnit &Unit, EmitKind Kind, raw_pwrite_stream &OS)
+{
+    if (!Unit.module()) {
+        Unit.Diagnostics.push_back({Diagnostic::NoOffset, "The unit has no module to emit"});
+        return false;
+    }
+    // As in ./main, a module that codegen rejected may still be written as IR,
+    // but the code generator would trip over it.
+    if (!Unit.ok() && (Kind == EmitKind::Obj || Kind == EmitKind::Exe)) {
+        Unit.Diagnostics.push_back({Diagnostic::NoOffset, "The unit has errors, not compiling it"});
+        return false;
+    }
+    ActiveCompilation Activate(*Unit.Context);
+    if (!EmitModule(*Unit.module(), Kind, OS)) {
+        Unit.Diagnostics.push_back({Diagnostic::NoOffset, "The target cannot emit object files"});
+        return false;
+    }
+    return true;
+}
+
+bool Compiler::run(CompilationUnit &Unit, int &Result)
+{
+    auto Fail = [&](string Message) {
+        Unit.Diagnostics.push_back({Diagnostic::NoOffset, std::move(Message)});
+        return false;
+    };
+    if (!Unit.ok() || !Unit.module()) return Fail("The unit has no valid module to run");
+
+    string Err;
+    if (!JIT) JIT = CreateJIT(Err);
+    if (!JIT) return Fail(Err);
+
+    CompilationContext &C = *Unit.Context;
+    orc::ResourceTrackerSP Tracker = JIT->getMainJITDylib().createResourceTracker();
+    auto Main = (int (*)())AddModuleToJIT(*JIT, orc::ThreadSafeModule(std::move(C.TheModule), std::move(C.TheContext)),
+                                          "main", Err, Tracker);
+    if (!Main) {
+        consumeError(Tracker->remove());
+        return Fail(Err);
+    }
+    Result = Main();
+    if (Error E = Tracker->remove()) return Fail("Cannot remove module from JIT: " + toString(std::move(E)));
+    return true;
+}
+
+#ifndef CODINGPARSER_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// main function
+//===----------------------------------------------------------------------===//
+static const char *Usage =
+    "Usage: %s [options]\n"
+    "  --input <file>  read the program from <file> instead of stdin\n"
+    "  --run           run the program in process with the JIT and exit with\n"
+    "                  its result instead of writing output.ll\n"
+    "  --interpret     evaluate the tree directly, without LLVM, and exit\n"
+    "                  with the result\n"
+    "  --tiered        like --interpret, but compile a loop with the JIT\n"
+    "                  once its body has run --tier-threshold=<n> times\n"
+    "                  (default 1000)\n"
+    "  --vm            run the program as bytecode in the VM, without LLVM,\n"
+    "                  and exit with the result\n"
+    "  --emit=<kind>   what to write: ll (LLVM IR, default), bc (LLVM\n"
+    "                  bitcode), obj (object file) or exe (executable linked\n"
+    "                  with cc)\n"
+    "  -o <file>       output file (default output.ll, output.bc, output.o\n"
+    "                  or a.out); - is stdout\n"
+    "  -march=<cpu>    generate code for <cpu>; native uses the host CPU\n"
+    "                  and all of its features\n"
+    "  -mcpu=<cpu>     same as -march=<cpu>\n"
+    "  -mattr=<list>   enable (+feature) or disable (-feature) CPU features\n"
+    "  --flat-ast      generate code from the flat AST\n"
+    "  --const-eval    evaluate constant expressions and ifs before codegen\n"
+    "  --dump-ast      print the parsed tree to stdout\n"
+    "  --dump-ir       print the generated IR to stderr\n"
+    "  --ir-stats      print the size of the generated IR\n"
+    "  --fold=<mode>   fold constants while building IR: none (default),\n"
+    "                  constant or target\n"
+    "  -O0 ... -O3, -Os\n"
+    "                  optimization level (default -O0: only variables are\n"
+    "                  promoted to registers)\n"
+    "  --time          print the time spent in each phase\n"
+    "  --time-passes   print the time spent in each optimization pass\n"
+    "  --arena-stats   print AST arena statistics (in every run mode)\n"
+    "  --quiet         no diagnostic output, even if asked for above\n"
+    "  --help          print this list and exit\n";
+
+int main(int argc, char **argv)
+{
+    CompilationContext Compilation;
+    Compilation.EchoErrors = true;
+    ActiveCompilation Activate(Compilation);
+
+    const char *InputFile = nullptr;
+    bool UseFlatAST = false;
+    bool ConstEval = false;
+    bool RunJIT = false;
+    bool Interpret = false;
+    bool RunVM = false;
+    bool Tiered = false;
+    uint32_t TierThreshold = 1000;
+    bool Quiet = false;
+    EmitKind Emit = EmitKind::LL;
+    const char *OutputFile = nullptr;
+    bool NeedTarget = false;
+    string CPU, Features;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--input") && i + 1 < argc) {
+            InputFile = argv[++i];
+        } else if (!strcmp(argv[i], "--emit=ll")) {
+            Emit = EmitKind::LL;
+        } else if (!strcmp(argv[i], "--emit=bc")) {
+            Emit = EmitKind::BC;
+        } else if (!strcmp(argv[i], "--emit=obj")) {
+            Emit = EmitKind::Obj;
+        } else if (!strcmp(argv[i], "--emit=exe")) {
+            Emit = EmitKind::Exe;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            OutputFile = argv[++i];
+        } else if (!strcmp(argv[i], "-march=native") || !strcmp(argv[i], "-mcpu=native")) {
+            // Any -mattr= given before is kept after the host's features, so
+            // it still wins.
+            CPU = sys::getHostCPUName().str();
+            Features = Features.empty() ? HostCPUFeatures() : HostCPUFeatures() + ',' + Features;
+            NeedTarget = true;
+        } else if (!strncmp(argv[i], "-march=", 7) || !strncmp(argv[i], "-mcpu=", 6)) {
+            CPU = strchr(argv[i], '=') + 1;
+            NeedTarget = true;
+        } else if (!strncmp(argv[i], "-mattr=", 7)) {
+            if (!Features.empty()) Features += ',';
+            Features += argv[i] + 7;
+            NeedTarget = true;
+        } else if (!strcmp(argv[i], "--flat-ast")) {
+            UseFlatAST = true;
+        } else if (!strcmp(argv[i], "--run")) {
+            RunJIT = true;
+        } else if (!strcmp(argv[i], "--interpret")) {
+            Interpret = true;
+        } else if (!strcmp(argv[i], "--tiered")) {
+            Interpret = Tiered = true;
+        } else if (!strncmp(argv[i], "--tier-threshold=", 17)) {
+            TierThreshold = strtoul(argv[i] + 17, nullptr, 10);
+            if (!TierThreshold) err_n_die(Usage, argv[0]);
+        } else if (!strcmp(argv[i], "--vm")) {
+            RunVM = true;
+        } else if (!strcmp(argv[i], "--const-eval")) {
+            ConstEval = true;
+        } else if (!strcmp(argv[i], "--dump-ast")) {
+            Trace.DumpAST = true;
+        } else if (!strcmp(argv[i], "--dump-ir")) {
+            Trace.DumpIR = true;
+        } else if (!strcmp(argv[i], "--ir-stats")) {
+            Trace.IRStats = true;
+        } else if (!strcmp(argv[i], "--fold=none")) {
+            Comp->Folding = FoldMode::None;
+        } else if (!strcmp(argv[i], "--fold=constant")) {
+            Comp->Folding = FoldMode::Constant;
+        } else if (!strcmp(argv[i], "--fold=target")) {
+            Comp->Folding = FoldMode::Target;
+        } else if (!strcmp(argv[i], "-O0")) {
+            Comp->OptLevel = OptimizationLevel::O0;
+        } else if (!strcmp(argv[i], "-O1")) {
+            Comp->OptLevel = OptimizationLevel::O1;
+        } else if (!strcmp(argv[i], "-O2")) {
+            Comp->OptLevel = OptimizationLevel::O2;
+        } else if (!strcmp(argv[i], "-O3")) {
+            Comp->OptLevel = OptimizationLevel::O3;
+        } else if (!strcmp(argv[i], "-Os")) {
+            Comp->OptLevel = OptimizationLevel::Os;
+        } else if (!strcmp(argv[i], "--time-passes")) {
+            Trace.TimePasses = true;
+        } else if (!strcmp(argv[i], "--time")) {
+            Trace.Time = true;
+        } else if (!strcmp(argv[i], "--arena-stats")) {
+            Trace.ArenaStats = true;
+        } else if (!strcmp(argv[i], "--quiet")) {
+            Quiet = true;
+        } else if (!strcmp(argv[i], "--help")) {
+            printf(Usage, argv[0]);
+            return 0;
+        } else {
+            err_n_die(Usage, argv[0]);
+        }
+    }
+    if (Quiet) Trace = TraceOptions();
+
+    // The tree dump is large; don't let a terminal make it line buffered.
+    if (Trace.DumpAST) setvbuf(stdout, nullptr, _IOFBF, 1 << 16);
+
+    // Without --input the lexer streams stdin as before.
+    StringRef Input = InputFile ? MapInputFile(InputFile) : StringRef();
+
+    // Without a target the IR stays target independent, as before.
+    unique_ptr<TargetMachine> Target;
+    if (!Interpret && !RunVM) {
+        if (NeedTarget || Emit == EmitKind::Obj || Emit == EmitKind::Exe) {
+            string Err;
+            Target = CreateTargetMachine(CPU, Features, Comp->OptLevel, Err);
+            if (!Target) err_n_die("Error: %s\n", Err.c_str());
+            Comp->TheTargetMachine = Target.get();
+        }
+        InitializeModule();
+    }
+
+    TokenBuffer Tokens;
+    {
+        PhaseTimer Timer("lex");
+        Symbols = &Comp->Symbols;
+        Tokens.lexAll(Input.size());
+    }
+
+    ASTArena Arena;
+    ParseResult Parsed;
+    {
+        PhaseTimer Timer("parse");
+        Parsed = Parser(Tokens, Arena).parseProgram();
+    }
+    if (!Parsed.ok()) {
+        PrintDiagnostics(Parsed.Diagnostics, Input);
+        return 1;
+    }
+    GenericASTNode *AST = Parsed.AST;
+
+    if (ConstEval) {
+        PhaseTimer Timer("consteval");
+        AST = FoldConstants(AST);
+    }
+
+    FlatAST Flat;
+    if (UseFlatAST) {
+        PhaseTimer Timer("flatten");
+        Flat.build(AST);
+    }
+
+    if (Trace.DumpAST) {
+        if (UseFlatAST)
+            Flat.print();
+        else
+            AST->toString();
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // The tree is complete here, whichever way it runs next.
+    if (Trace.ArenaStats) Arena.printStats(stderr);
+
+    if (Interpret) {
+        Interpreter Interp(Tiered ? TierThreshold : 0);
+        int32_t Result;
+        bool Valid;
+        {
+            PhaseTimer Timer("eval");
+            Valid = Interp.run(AST, Result);
+        }
+        if (!Valid) err_n_die("Error: Program has errors, not running it\n");
+        return Result;
+    }
+
+    if (RunVM) {
+        BytecodeVM VM;
+        bool Valid;
+        {
+            PhaseTimer Timer("lower");
+            Valid = VM.build(AST);
+        }
+        if (!Valid) err_n_die("Error: Program has errors, not running it\n");
+        if (Trace.IRStats) fprintf(stderr, "Bytecode: %zu instructions, %u registers\n", VM.size(), VM.registers());
+        PhaseTimer Timer("vm");
+        return VM.run();
+    }
+
+    bool Valid;
+    {
+        PhaseTimer Timer("codegen");
+        if (UseFlatAST)
+            Valid = CodeGenTopLevel([&] { return Flat.codegen(); });
+        else
+            Valid = CodeGenTopLevel([&] { return AST->codegen(); });
+    }
+
+    {
+        PhaseTimer Timer("free");
+        Arena.release();
+    }
+
+    if (RunJIT) {
+        if (!Valid) err_n_die("Error: Program has errors, not running it\n");
+        return RunMainInProcess();
+    }
+
+    if (!Valid && (Emit == EmitKind::Obj || Emit == EmitKind::Exe)) err_n_die("Error: Program has errors, not compiling it\n");
+
+    {
+        PhaseTimer Timer("emit");
+        switch (Emit) {
+            case EmitKind::LL:
+                WriteOutputFile(Emit, OutputFile ? OutputFile : "output.ll");
+                break;
+            case EmitKind::BC:
+                WriteOutputFile(Emit, OutputFile ? OutputFile : "output.bc");
+                break;
+            case EmitKind::Obj:
+                WriteOutputFile(Emit, OutputFile ? OutputFile : "output.o");
+                break;
+            case EmitKind::Exe:
+                WriteExecutable(OutputFile ? OutputFile : "a.out");
+                break;
+        }
+    }
+
+    // IR that codegen gave up on is still written for inspection, but the
+    // compile has failed.
+    return Valid ? 0 : 1;
+}
+
+#endif
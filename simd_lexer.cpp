@@ -0,0 +1,233 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "lexer.h"
+#include "symbol_table.h"
+
+//===----------------------------------------------------------------------===//
+// Hand-written lexer
+//
+// Drop-in replacement for the flex scanner generated from lexer.l. It keeps
+// the yylex()/yylval interface and produces the same token stream:
+//   [0-9]+           NUMBER, yylval = atoi(yytext)
+//   [{}+()=\n;]      the character itself
+//   if, else, while  IF, ELSE, WHILE
+//   [A-Za-z_][A-Za-z0-9_]*
+//                    IDENT, yylval = the name's ID in *Symbols
+//   anything else    echoed to yyecho (flex's default rule)
+// Character classes are computed 32 (AVX2) or 16 (SSE2) bytes at a time, so
+// digit runs and runs of echoed text are crossed in a few vector steps.
+//===----------------------------------------------------------------------===//
+int yylval;
+size_t yyoffset;
+FILE *yyecho = stdout;
+
+static char *Buf;
+static const char *Cur;
+static const char *End;
+
+struct yy_buffer_state {
+    char *Base;
+    size_t Size;
+};
+static yy_buffer_state Scanned;
+
+#if defined(__AVX2__)
+#define LEX_SIMD_WIDTH 32
+typedef __m256i Vec;
+static const uint32_t LaneMask = 0xFFFFFFFFu;
+static inline Vec load(const char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline Vec splat(char c) { return _mm256_set1_epi8(c); }
+static inline Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline Vec gt(Vec a, Vec b) { return _mm256_cmpgt_epi8(a, b); }
+static inline Vec vor(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+static inline Vec vand(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+static inline uint32_t bits(Vec v) { return (uint32_t)_mm256_movemask_epi8(v); }
+#elif defined(__SSE2__)
+#define LEX_SIMD_WIDTH 16
+typedef __m128i Vec;
+static const uint32_t LaneMask = 0xFFFFu;
+static inline Vec load(const char *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline Vec splat(char c) { return _mm_set1_epi8(c); }
+static inline Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+static inline Vec gt(Vec a, Vec b) { return _mm_cmpgt_epi8(a, b); }
+static inline Vec vor(Vec a, Vec b) { return _mm_or_si128(a, b); }
+static inline Vec vand(Vec a, Vec b) { return _mm_and_si128(a, b); }
+static inline uint32_t bits(Vec v) { return (uint32_t)_mm_movemask_epi8(v); }
+#endif
+
+enum CharClass : unsigned char { Plain, Digit, Punct, Ident };
+
+static struct CharClassTable {
+    unsigned char Of[256];
+    CharClassTable()
+    {
+        memset(Of, Plain, sizeof(Of));
+        for (int c = '0'; c <= '9'; ++c) Of[c] = Digit;
+        for (const char *p = "{}+()=\n;"; *p; ++p) Of[(unsigned char)*p] = Punct;
+        for (int c = 'a'; c <= 'z'; ++c) Of[c] = Of[c - 'a' + 'A'] = Ident;
+        Of['_'] = Ident;
+    }
+} Classes;
+
+static inline CharClass classOf(char c) { return (CharClass)Classes.Of[(unsigned char)c]; }
+
+#ifdef LEX_SIMD_WIDTH
+// Signed compares: bytes >= 0x80 are negative and never count as digits.
+static inline Vec digitLanes(Vec v)
+{
+    return vand(gt(v, splat('0' - 1)), gt(splat('9' + 1), v));
+}
+
+// Setting bit 5 maps 'A'-'Z' onto 'a'-'z' and nothing else onto them.
+static inline Vec letterLanes(Vec v)
+{
+    Vec l = vor(v, splat(0x20));
+    return vand(gt(l, splat('a' - 1)), gt(splat('z' + 1), l));
+}
+
+static inline Vec specialLanes(Vec v)
+{
+    Vec m = vor(digitLanes(v), letterLanes(v));
+    m = vor(m, vor(eq(v, splat('{')), eq(v, splat('}'))));
+    m = vor(m, vor(eq(v, splat('+')), eq(v, splat('('))));
+    m = vor(m, vor(eq(v, splat(')')), eq(v, splat('='))));
+    m = vor(m, vor(eq(v, splat('\n')), eq(v, splat(';'))));
+    return vor(m, eq(v, splat('_')));
+}
+#endif
+
+// Returns the first byte at or after p that is not a digit.
+static const char *skipDigits(const char *p)
+{
+#ifdef LEX_SIMD_WIDTH
+    while (End - p >= LEX_SIMD_WIDTH) {
+        uint32_t m = ~bits(digitLanes(load(p))) & LaneMask;
+        if (m) return p + __builtin_ctz(m);
+        p += LEX_SIMD_WIDTH;
+    }
+#endif
+    while (p < End && classOf(*p) == Digit) ++p;
+    return p;
+}
+
+// Returns the first byte at or after p that may start a token.
+static const char *skipPlain(const char *p)
+{
+#ifdef LEX_SIMD_WIDTH
+    while (End - p >= LEX_SIMD_WIDTH) {
+        uint32_t m = bits(specialLanes(load(p)));
+        if (m) return p + __builtin_ctz(m);
+        p += LEX_SIMD_WIDTH;
+    }
+#endif
+    while (p < End && classOf(*p) == Plain) ++p;
+    return p;
+}
+
+// Identifiers are short; a scalar loop over the class table is enough.
+static const char *skipIdent(const char *p)
+{
+    while (p < End && (classOf(*p) == Ident || classOf(*p) == Digit)) ++p;
+    return p;
+}
+
+// Same value atoi() gives for the digit run [b, e): strtol() saturates at
+// LONG_MAX and the result is narrowed to int, so only runs too long to
+// accumulate exactly are handed to strtol().
+static int toInt(const char *b, const char *e)
+{
+    if (e - b > 18) return (int)strtol(b, nullptr, 10);
+    long v = 0;
+    for (; b != e; ++b) v = v * 10 + (*b - '0');
+    return (int)v;
+}
+
+// Like flex, the longest match wins: "iffy" is an identifier, not IF.
+static int keyword(const char *b, size_t len)
+{
+    if (len == 2 && memcmp(b, "if", 2) == 0) return IF;
+    if (len == 4 && memcmp(b, "else", 4) == 0) return ELSE;
+    if (len == 5 && memcmp(b, "while", 5) == 0) return WHILE;
+    return 0;
+}
+
+// Unlike flex, which refills its buffer on demand, the whole of stdin is read
+// up front. The buffer is NUL terminated so strtol() stops at the end.
+static void readInput(FILE *in)
+{
+    size_t cap = 1 << 16, len = 0, n;
+    Buf = (char *)malloc(cap + 1);
+    while ((n = fread(Buf + len, 1, cap - len, in)) > 0) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            Buf = (char *)realloc(Buf, cap + 1);
+        }
+    }
+    Buf[len] = '\0';
+    Cur = Buf;
+    End = Buf + len;
+}
+
+// The buffer is only read, so a read-only or shared mapping works here too.
+YY_BUFFER_STATE yy_scan_buffer(char *base, size_t size)
+{
+    if (size < 2 || base[size - 2] != '\0' || base[size - 1] != '\0') return nullptr;
+    Scanned.Base = Buf = base;
+    Scanned.Size = size;
+    Cur = base;
+    End = base + size - 2;
+    return &Scanned;
+}
+
+// The buffer is the caller's; as with flex, lexing afterwards reads stdin.
+void yy_delete_buffer(YY_BUFFER_STATE b)
+{
+    if (b != &Scanned || Buf != Scanned.Base) return;
+    Buf = nullptr;
+    Cur = End = nullptr;
+}
+
+int yylex()
+{
+    if (!Buf) readInput(stdin);
+
+    while (Cur != End) {
+        yyoffset = Cur - Buf;
+        switch (classOf(*Cur)) {
+            case Digit: {
+                const char *e = skipDigits(Cur + 1);
+                yylval = toInt(Cur, e);
+                Cur = e;
+                return NUMBER;
+            }
+            case Punct:
+                return *Cur++;
+            case Ident: {
+                const char *e = skipIdent(Cur + 1);
+                int kw = keyword(Cur, e - Cur);
+                if (!kw) {
+                    yylval = Symbols->intern(Cur, e - Cur);
+                    kw = IDENT;
+                }
+                Cur = e;
+                return kw;
+            }
+            case Plain: {
+                const char *p = skipPlain(Cur + 1);
+                if (yyecho) fwrite(Cur, 1, p - Cur, yyecho);
+                Cur = p;
+                break;
+            }
+        }
+    }
+    yyoffset = End - Buf;
+    return 0;
+}
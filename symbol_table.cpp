@@ -0,0 +1,65 @@
+#include <cstring>
+
+#include "symbol_table.h"
+
+static SymbolTable DefaultSymbols;
+SymbolTable *Symbols = &DefaultSymbols;
+
+static const size_t BlockSize = 64 * 1024;
+
+// FNV-1a; identifiers are short, so this is cheaper than anything wider.
+static uint32_t hashName(const char *Text, size_t Len)
+{
+    uint32_t H = 2166136261u;
+    for (size_t i = 0; i < Len; ++i) H = (H ^ (unsigned char)Text[i]) * 16777619u;
+    return H;
+}
+
+const char *SymbolTable::store(const char *Text, size_t Len)
+{
+    if ((size_t)(End - Cur) < Len + 1) {
+        size_t Size = Len + 1 > BlockSize ? Len + 1 : BlockSize;
+        Blocks.emplace_back(new char[Size]);
+        Cur = Blocks.back().get();
+        End = Cur + Size;
+    }
+    char *Name = Cur;
+    memcpy(Name, Text, Len);
+    Name[Len] = '\0';
+    Cur += Len + 1;
+    return Name;
+}
+
+void SymbolTable::grow()
+{
+    std::vector<uint32_t> Old(Slots.empty() ? 64 : Slots.size() * 2, 0);
+    Old.swap(Slots);
+    size_t Mask = Slots.size() - 1;
+    for (uint32_t Slot : Old) {
+        if (!Slot) continue;
+        size_t i = Hashes[Slot - 1] & Mask;
+        while (Slots[i]) i = (i + 1) & Mask;
+        Slots[i] = Slot;
+    }
+}
+
+uint32_t SymbolTable::intern(const char *Text, size_t Len)
+{
+    // Kept at most three quarters full, so probing always ends.
+    if ((Names.size() + 1) * 4 > Slots.size() * 3) grow();
+
+    uint32_t H = hashName(Text, Len);
+    size_t Mask = Slots.size() - 1;
+    size_t i = H & Mask;
+    for (; Slots[i]; i = (i + 1) & Mask) {
+        uint32_t ID = Slots[i] - 1;
+        if (Hashes[ID] == H && Lengths[ID] == Len && !memcmp(Names[ID], Text, Len)) return ID;
+    }
+
+    uint32_t ID = Names.size();
+    Names.push_back(store(Text, Len));
+    Hashes.push_back(H);
+    Lengths.push_back(Len);
+    Slots[i] = ID + 1;
+    return ID;
+}
@@ -0,0 +1,41 @@
+#ifndef CODINGPARSER_SYMBOL_TABLE_H
+#define CODINGPARSER_SYMBOL_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Interns identifiers. Each distinct name is copied once into a string pool
+// and gets a dense 32-bit ID, in order of first appearance; the lexer hands
+// out only IDs, so everything after it compares integers, not strings.
+// Plain C++ with no LLVM dependency, since both lexer backends and
+// lexer_bench use it.
+class SymbolTable {
+    // Open addressing; each slot holds ID + 1, or 0 when empty.
+    std::vector<uint32_t> Slots;
+    std::vector<uint32_t> Hashes;
+    std::vector<uint32_t> Lengths;
+    std::vector<const char *> Names;
+
+    // Names are stored NUL terminated in blocks that never move.
+    std::vector<std::unique_ptr<char[]>> Blocks;
+    char *Cur = nullptr;
+    char *End = nullptr;
+
+    const char *store(const char *Text, size_t Len);
+    void grow();
+
+public:
+    uint32_t intern(const char *Text, size_t Len);
+
+    const char *name(uint32_t ID) const { return Names[ID]; }
+    size_t length(uint32_t ID) const { return Lengths[ID]; }
+    size_t size() const { return Names.size(); }
+};
+
+// The table the lexer interns into. It starts out pointing to a table of its
+// own; a compilation points it to its own table before lexing.
+extern SymbolTable *Symbols;
+
+#endif